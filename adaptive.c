@@ -0,0 +1,194 @@
+/*
+ * adaptive.c - adaptive Huffman coding
+ *
+ * Copyright (C) 2008 Jussi Mäki <joamaki@gmail.com>
+ *
+ * Algorithm FGK: the tree starts out as a single NYT ("not yet
+ * transmitted") leaf. A symbol seen for the first time is sent as the
+ * code of NYT followed by the symbol in SYMBOL_BITS bits, and NYT then
+ * splits into a new NYT and a leaf for the symbol. After each symbol
+ * the weights on the path to the root are incremented, keeping the
+ * sibling property: nodes numbered by nondecreasing weight with
+ * siblings next to each other. Before its weight is incremented, a
+ * node swaps places with the highest numbered node of the same weight.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+
+#include "util.h"
+#include "bitfile.h"
+#include "huffman.h"
+#include "adaptive.h"
+
+/* Leaves for all symbols and NYT, and the internal nodes joining them */
+#define NODES (2*(HCA_SYMBOLS+1) - 1)
+
+/* The root has the highest number */
+#define ROOT (NODES-1)
+
+/* Bits of a symbol sent after NYT */
+#define SYMBOL_BITS 9
+
+/* Content of a leaf node */
+#define LEAF(symbol) (NODES + (symbol))
+#define IS_LEAF(content) ((content) >= NODES)
+#define NYT LEAF(HCA_SYMBOLS)
+
+/* Nodes are stored by their number. A number keeps its parent when
+   subtrees are swapped, only the weight and the content move. */
+struct hcadaptive {
+	u64 weight[NODES];
+	u16 parent[NODES];
+	u16 content[NODES]; /* Right child (the left one is right-1) or
+			       LEAF(symbol) */
+	u16 leaf[HCA_SYMBOLS+1]; /* Number of each leaf, 0 if none */
+	u16 next;                /* Lowest number in use */
+};
+
+struct hcadaptive * adaptive_new(void)
+{
+	struct hcadaptive *a = xmalloc(sizeof(struct hcadaptive));
+	int i;
+
+	for (i=0; i<=HCA_SYMBOLS; i++)
+		a->leaf[i] = 0;
+
+	a->weight[ROOT] = 0;
+	a->parent[ROOT] = ROOT;
+	a->content[ROOT] = NYT;
+	a->leaf[HCA_SYMBOLS] = ROOT;
+	a->next = ROOT;
+
+	return a;
+}
+
+void adaptive_free(struct hcadaptive *a)
+{
+	xfree(a);
+}
+
+/* Point the children or the leaf of the content at 'n' back at it */
+static void attach(struct hcadaptive *a, int n)
+{
+	int c = a->content[n];
+
+	if (IS_LEAF(c)) {
+		a->leaf[c - NODES] = n;
+	} else {
+		a->parent[c] = n;
+		a->parent[c-1] = n;
+	}
+}
+
+/* Split NYT into a new NYT and a leaf for 'symbol'. Returns the
+   number of the new leaf. */
+static int add_symbol(struct hcadaptive *a, int symbol)
+{
+	int n = a->leaf[HCA_SYMBOLS];
+
+	assert(a->next >= 2);
+
+	a->content[n] = n-1;
+	a->weight[n-1] = a->weight[n-2] = 0;
+	a->parent[n-1] = a->parent[n-2] = n;
+	a->content[n-1] = LEAF(symbol);
+	a->content[n-2] = NYT;
+	a->leaf[symbol] = n-1;
+	a->leaf[HCA_SYMBOLS] = n-2;
+	a->next = n-2;
+
+	return n-1;
+}
+
+/* Count one more 'symbol' */
+static void update(struct hcadaptive *a, int symbol)
+{
+	int n = a->leaf[symbol];
+
+	if (n == 0)
+		n = add_symbol(a, symbol);
+
+	while (n != ROOT) {
+		int leader = n;
+
+		while (leader < ROOT && a->weight[leader+1] == a->weight[n])
+			leader++;
+
+		/* Parent of the same weight only when the sibling is NYT */
+		if (leader != n && leader != a->parent[n]) {
+			u16 c = a->content[n];
+
+			a->content[n] = a->content[leader];
+			a->content[leader] = c;
+			attach(a, n);
+			attach(a, leader);
+			n = leader;
+		}
+
+		a->weight[n]++;
+		n = a->parent[n];
+	}
+	a->weight[ROOT]++;
+}
+
+int adaptive_encode(struct hcadaptive *a, struct bitfile *bf, int symbol)
+{
+	u8 path[NODES];
+	int n = a->leaf[symbol], len = 0, bits;
+
+	assert(symbol >= 0 && symbol < HCA_SYMBOLS);
+
+	if (n == 0)
+		n = a->leaf[HCA_SYMBOLS];
+
+	/* Collect the path from the leaf up, then write it from the root */
+	for (; n != ROOT; n = a->parent[n])
+		path[len++] = a->content[a->parent[n]] == n;
+
+	for (bits = len; len > 0; ) {
+		u64 code = 0;
+		int i;
+
+		for (i=0; i<56 && len > 0; i++)
+			code = (code << 1) | path[--len];
+		bitfile_put_code(bf, code, i);
+	}
+
+	if (a->leaf[symbol] == 0) {
+		bitfile_put_code(bf, symbol, SYMBOL_BITS);
+		bits += SYMBOL_BITS;
+	}
+
+	update(a, symbol);
+	return bits;
+}
+
+int adaptive_decode(struct hcadaptive *a, struct bitfile *bf, u64 *bits)
+{
+	int n = ROOT, symbol;
+
+	while (!IS_LEAF(a->content[n])) {
+		u8 bit;
+
+		if (bitfile_get_bit(bf, &bit) != 0)
+			return HC_DECODE_END;
+		n = a->content[n] - !bit;
+		(*bits)++;
+	}
+
+	symbol = a->content[n] - NODES;
+	if (symbol == HCA_SYMBOLS) {
+		if (bitfile_refill_bits(bf) < SYMBOL_BITS)
+			return HC_DECODE_END;
+		symbol = bitfile_peek_bits(bf, SYMBOL_BITS);
+		bitfile_consume_bits(bf, SYMBOL_BITS);
+		*bits += SYMBOL_BITS;
+		if (symbol >= HCA_SYMBOLS || a->leaf[symbol] != 0)
+			return HC_DECODE_INVALID;
+	}
+
+	update(a, symbol);
+	return symbol;
+}
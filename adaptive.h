@@ -0,0 +1,34 @@
+/*
+ * adaptive.h - adaptive Huffman coding
+ *
+ * Copyright (C) 2008 Jussi Mäki <joamaki@gmail.com>
+ */
+
+#ifndef __ADAPTIVE_H
+#define __ADAPTIVE_H
+
+/* Symbols of the adaptive code: 256 chars and the pseudo-EOF */
+#define HCA_SYMBOLS 257
+
+struct hcadaptive;
+struct bitfile;
+
+/* Allocate a coder knowing no symbols yet. The encoder and the decoder
+   start from the same state and stay in step by updating the code
+   after every symbol. */
+struct hcadaptive * adaptive_new(void);
+
+/* Free a coder */
+void adaptive_free(struct hcadaptive *a);
+
+/* Write the code of 'symbol' into 'bf' and update the code. Returns
+   the number of bits written. */
+int adaptive_encode(struct hcadaptive *a, struct bitfile *bf, int symbol);
+
+/* Read a symbol from 'bf' and update the code, adding the number of
+   bits read to 'bits'. Returns the symbol, HC_DECODE_END if the input
+   ends within a code or HC_DECODE_INVALID if a new symbol is out of
+   range or not new. */
+int adaptive_decode(struct hcadaptive *a, struct bitfile *bf, u64 *bits);
+
+#endif /* __ADAPTIVE_H */
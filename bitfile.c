@@ -4,61 +4,311 @@
  * Copyright (C) 2008 Jussi Mäki <joamaki@gmail.com>
  */
 
+#define _DEFAULT_SOURCE /* fileno(), madvise(), pthreads */
+
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include "util.h"
 #include "bitfile.h"
 
 /* Number of bytes to buffer at a time */
 #define BITFILE_BUFFER_LEN 4096
 
+/* Backends */
+#define BITFILE_FILE 0
+#define BITFILE_MMAP 1
+#define BITFILE_MEMORY 2
+
+/* Room before each asynchronous read chunk for the unconsumed tail of
+ * the previous chunk (the bit reader refills when less than 8 bytes are
+ * left) */
+#define BITFILE_HEADROOM 8
+
+/* State of the helper thread doing the I/O of an asynchronous bitfile.
+ * The bitfile works on one chunk buffer while the thread reads the next
+ * chunk into, or writes the previous chunk from, the other buffer. */
+struct bitfile_async {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	u8 *bufs[2];       /* Chunk buffers of 'chunk_len' bytes, each
+			    * with BITFILE_HEADROOM bytes before it */
+	size_t chunk_len;
+
+	u8 *io_buf;        /* Buffer of the current request */
+	size_t io_len;     /* Bytes to write, or bytes read when done */
+	int io_errno;      /* Non-zero if the request failed */
+	int busy;          /* Non-zero while a request is pending */
+	int quit;          /* Tells the thread to exit */
+
+	int eof;           /* Only used when reading;
+			    * end of file has been reached */
+};
+
 struct bitfile {
 	FILE *file;
 
 	int big_endian;    /* non-zero if platform is big-endian */
 
-	u8 *buffer;        /* Data buffer.
-			    * If reading this grows with the input,
-			    * If writing the buffer doesn't grow
-			    * and gets emptied when full
+	u8 *buffer;        /* Data buffer of BITFILE_BUFFER_LEN bytes.
+			    * If reading, consumed data is dropped
+			    * when the buffer is refilled.
+			    * If writing, the buffer gets emptied
+			    * when full.
 			    */
 
 	u8 *buffer_end;    /* End of buffer (allocation) */
 
 	u8 *pos;           /* Current position in buffer */
-	int bit_pos;       /* Bit-position on current byte */
+	int bit_pos;       /* Only used when writing;
+			    * bit-position on current byte */
+
+	u64 acc;           /* Only used when writing;
+			    * bit accumulator of bitfile_put_code(),
+			    * holds 'acc_bits' bits not yet in buffer.
+			    * bit_pos is 0 while acc_bits is non-zero. */
+	int acc_bits;
 
 	u8 *read_end;      /* Only used when reading;
 			    * This signifies the end of
 			    * readable part of buffer. */
 
+	u64 bitbuf;        /* Only used when reading;
+			    * bit container, next bit in the most
+			    * significant position. Holds 'bitcount'
+			    * bits read ahead from buffer. Bits past
+			    * 'bitcount' are either zero or the
+			    * correct following bits. */
+	int bitcount;
+
+	int backend;       /* BITFILE_FILE: buffered stdio file,
+			    * BITFILE_MMAP: buffer is the whole file
+			    * mapped into memory (reading only),
+			    * BITFILE_MEMORY: buffer is caller's
+			    * memory or output growing in memory. */
+
+	/* Only used with BITFILE_MEMORY when writing */
+	u8 *mem;           /* Output buffer */
+	size_t mem_len;    /* Size of output buffer */
+	int mem_grow;      /* Non-zero if output buffer is ours and grows */
+	size_t mem_lost;   /* Bytes that did not fit into a fixed-size
+			    * output buffer; these go through a
+			    * scratch buffer just to be counted. */
+
+	struct bitfile_async *async; /* Non-NULL if I/O is done by a
+				      * helper thread */
+
+	int dropped;       /* Only used when reading;
+			    * non-zero once data from the start of
+			    * the file has been dropped from buffer. */
+
 	char mode;         /* Mode: 'r' (read) or 'w' (write) */
 };
 
-/* Extends buffer with more data */
+static void * async_thread(void *arg)
+{
+	struct bitfile *bf = arg;
+	struct bitfile_async *as = bf->async;
+	size_t len;
+	int err;
+
+	pthread_mutex_lock(&as->lock);
+	while (1) {
+		while (!as->busy && !as->quit)
+			pthread_cond_wait(&as->cond, &as->lock);
+		if (!as->busy)
+			break;
+		pthread_mutex_unlock(&as->lock);
+
+		err = 0;
+		if (bf->mode == 'r') {
+			len = fread(as->io_buf, 1, as->chunk_len, bf->file);
+			if (ferror(bf->file))
+				err = errno ? errno : EIO;
+		} else {
+			len = as->io_len;
+			if (1 != fwrite(as->io_buf, len, 1, bf->file))
+				err = errno ? errno : EIO;
+		}
+
+		pthread_mutex_lock(&as->lock);
+		as->io_len = len;
+		as->io_errno = err;
+		as->busy = 0;
+		pthread_cond_broadcast(&as->cond);
+	}
+	pthread_mutex_unlock(&as->lock);
+
+	return NULL;
+}
+
+/* Waits for the pending request to finish */
+static void async_wait(struct bitfile *bf)
+{
+	struct bitfile_async *as = bf->async;
+
+	pthread_mutex_lock(&as->lock);
+	while (as->busy)
+		pthread_cond_wait(&as->cond, &as->lock);
+	pthread_mutex_unlock(&as->lock);
+
+	if (as->io_errno) {
+		error("Unable to %s file: %s",
+		      bf->mode == 'r' ? "read" : "write",
+		      strerror(as->io_errno));
+	}
+}
+
+/* Hands a chunk over to the helper thread. Reads fill the whole chunk. */
+static void async_submit(struct bitfile *bf, u8 *buf, size_t len)
+{
+	struct bitfile_async *as = bf->async;
+
+	pthread_mutex_lock(&as->lock);
+	as->io_buf = buf;
+	as->io_len = len;
+	as->busy = 1;
+	pthread_cond_broadcast(&as->cond);
+	pthread_mutex_unlock(&as->lock);
+}
+
+/* Returns the chunk buffer not currently used by the bitfile */
+static u8 * async_other(struct bitfile *bf)
+{
+	struct bitfile_async *as = bf->async;
+
+	return bf->buffer == as->bufs[0] ? as->bufs[1] : as->bufs[0];
+}
+
+/* Switches to the chunk read ahead by the helper thread and starts
+ * reading the next one into the chunk just consumed */
+static void async_read_buffer(struct bitfile *bf)
+{
+	struct bitfile_async *as = bf->async;
+	size_t left = bf->read_end - bf->pos;
+	u8 *next = async_other(bf);
+	size_t rlen;
+
+	if (as->eof)
+		return;
+
+	async_wait(bf);
+	rlen = as->io_len;
+	if (rlen == 0) {
+		as->eof = 1;
+		return;
+	}
+
+	/* Carry the unconsumed tail over in front of the new chunk */
+	assert(left <= BITFILE_HEADROOM);
+	memcpy(next - left, bf->pos, left);
+
+	async_submit(bf, bf->buffer, 0);
+
+	bf->buffer = next;
+	bf->buffer_end = next + as->chunk_len;
+	bf->pos = next - left;
+	bf->read_end = next + rlen;
+	bf->dropped = 1;
+}
+
+/* Starts writing out the current chunk and switches to the other one
+ * once its previous write has finished */
+static void async_write_buffer(struct bitfile *bf, size_t wlen)
+{
+	struct bitfile_async *as = bf->async;
+	u8 *next = async_other(bf);
+
+	async_wait(bf);
+	async_submit(bf, bf->buffer, wlen);
+
+	bf->buffer = next;
+	bf->buffer_end = next + as->chunk_len;
+}
+
+/* Finishes pending I/O and stops the helper thread */
+static void async_close(struct bitfile *bf)
+{
+	struct bitfile_async *as = bf->async;
+
+	async_wait(bf);
+
+	pthread_mutex_lock(&as->lock);
+	as->quit = 1;
+	pthread_cond_broadcast(&as->cond);
+	pthread_mutex_unlock(&as->lock);
+
+	pthread_join(as->thread, NULL);
+	pthread_mutex_destroy(&as->lock);
+	pthread_cond_destroy(&as->cond);
+
+	xfree(as->bufs[0] - BITFILE_HEADROOM);
+	xfree(as->bufs[1] - BITFILE_HEADROOM);
+	xfree(as);
+	bf->async = NULL;
+	bf->buffer = NULL;
+}
+
+/* Refills buffer with more data. Unconsumed data is moved to the
+ * start of the buffer, so memory use stays bounded by the buffer
+ * size no matter how large the input is. */
 static void read_buffer(struct bitfile *bf)
 {
+	size_t left = bf->read_end - bf->pos;
 	size_t rlen;
 
-	if (bf->buffer_end < (bf->read_end + BITFILE_BUFFER_LEN)) {
-		size_t old_len = bf->buffer_end - bf->buffer;
-		size_t old_pos = bf->pos - bf->buffer;
-		size_t old_rend = bf->read_end - bf->buffer;
+	/* The whole input is already there */
+	if (bf->backend != BITFILE_FILE)
+		return;
+
+	if (bf->async) {
+		async_read_buffer(bf);
+		return;
+	}
 
-		bf->buffer = xrealloc(bf->buffer, old_len * 2);
-		bf->buffer_end = bf->buffer + old_len * 2;
-		bf->pos = bf->buffer + old_pos;
-		bf->read_end = bf->buffer + old_rend;
+	if (bf->pos != bf->buffer) {
+		memmove(bf->buffer, bf->pos, left);
+		bf->pos = bf->buffer;
+		bf->read_end = bf->buffer + left;
+		bf->dropped = 1;
 	}
 
-	rlen = fread(bf->read_end, 1, BITFILE_BUFFER_LEN, bf->file);
+	rlen = fread(bf->read_end, 1, bf->buffer_end - bf->read_end, bf->file);
 	if (rlen != 0) {
 		bf->read_end += rlen;
 	}
 }
 
+/* Makes room for more output in memory. A growing buffer is doubled,
+ * a full fixed-size buffer is replaced by a scratch buffer. */
+static void memory_write_buffer(struct bitfile *bf)
+{
+	size_t used = bf->pos - bf->buffer;
+
+	if (bf->mem_grow) {
+		bf->mem_len *= 2;
+		bf->mem = bf->buffer = xrealloc(bf->mem, bf->mem_len);
+		bf->buffer_end = bf->buffer + bf->mem_len;
+		bf->pos = bf->buffer + used;
+		return;
+	}
+
+	if (bf->buffer == bf->mem)
+		bf->buffer = xmalloc(BITFILE_BUFFER_LEN);
+	else
+		bf->mem_lost += used;
+
+	bf->buffer_end = bf->buffer + BITFILE_BUFFER_LEN;
+	bf->pos = bf->buffer;
+}
+
 /* Writes the buffer to a file and resets position */
 static void write_buffer(struct bitfile *bf)
 {
@@ -70,8 +320,15 @@ static void write_buffer(struct bitfile *bf)
 
 	assert (bf->pos <= bf->buffer_end+1);
 
+	if (bf->backend == BITFILE_MEMORY) {
+		memory_write_buffer(bf);
+		return;
+	}
+
 	wlen = bf->pos - bf->buffer;
-	if (wlen) {
+	if (wlen && bf->async) {
+		async_write_buffer(bf, wlen);
+	} else if (wlen) {
 		if (1 != fwrite(bf->buffer, wlen, 1, bf->file)) {
 			error("Unable to write %d bytes "
 			      "from buffer to file: %s",
@@ -80,15 +337,67 @@ static void write_buffer(struct bitfile *bf)
 		}
 	}
 
-	memset(bf->buffer, 0, BITFILE_BUFFER_LEN);
+	memset(bf->buffer, 0, bf->buffer_end - bf->buffer);
 	bf->pos = bf->buffer;
 }
 
-struct bitfile * bitfile_from_file(FILE *file, const char *mode)
+/* Stores a 64-bit word into buffer, most significant byte first */
+static void store_be64(u8 *p, u64 w)
+{
+	p[0] = (u8)(w >> 56);
+	p[1] = (u8)(w >> 48);
+	p[2] = (u8)(w >> 40);
+	p[3] = (u8)(w >> 32);
+	p[4] = (u8)(w >> 24);
+	p[5] = (u8)(w >> 16);
+	p[6] = (u8)(w >> 8);
+	p[7] = (u8)w;
+}
+
+/* Moves the whole bytes of the accumulator into the buffer */
+static void flush_acc(struct bitfile *bf)
+{
+	if (bf->acc_bits < 8)
+		return;
+
+	if (bf->pos + 8 <= bf->buffer_end) {
+		/* Store the whole word and advance over the complete bytes */
+		store_be64(bf->pos, bf->acc << (64 - bf->acc_bits));
+		bf->pos += bf->acc_bits >> 3;
+		bf->acc_bits &= 7;
+		if (bf->pos >= bf->buffer_end)
+			write_buffer(bf);
+	} else {
+		while (bf->acc_bits >= 8) {
+			bf->acc_bits -= 8;
+			*bf->pos++ = (u8)(bf->acc >> bf->acc_bits);
+			if (bf->pos >= bf->buffer_end)
+				write_buffer(bf);
+		}
+	}
+}
+
+/* Empties the accumulator, leaving the last partial byte at bf->pos
+ * so that the bit and byte writers can continue from it */
+static void drain_acc(struct bitfile *bf)
+{
+	flush_acc(bf);
+
+	if (bf->acc_bits) {
+		*bf->pos = (u8)(bf->acc << (8 - bf->acc_bits));
+		bf->bit_pos = bf->acc_bits;
+		bf->acc_bits = 0;
+	}
+}
+
+/* Allocates a bitfile without a buffer */
+static struct bitfile * new_bitfile(FILE *file, const char *mode)
 {
 	struct bitfile * bf = xmalloc(sizeof(struct bitfile));
 	int test = 1;
 
+	assert (*mode == 'r' || *mode == 'w');
+
 	bf->file = file;
 
 	/* Check endianess by checking if LSB is first */
@@ -97,21 +406,40 @@ struct bitfile * bitfile_from_file(FILE *file, const char *mode)
 	else
 		bf->big_endian = 1;
 
+	bf->buffer = bf->buffer_end = NULL;
+	bf->pos = bf->read_end = NULL;
+	bf->bit_pos = 0;
+	bf->backend = BITFILE_FILE;
+	bf->mem = NULL;
+	bf->mem_len = 0;
+	bf->mem_grow = 0;
+	bf->mem_lost = 0;
+	bf->async = NULL;
+	bf->dropped = 0;
+	bf->acc = 0;
+	bf->acc_bits = 0;
+	bf->bitbuf = 0;
+	bf->bitcount = 0;
+
+	bf->mode = *mode;
+
+	return bf;
+}
+
+struct bitfile * bitfile_from_file(FILE *file, const char *mode)
+{
+	struct bitfile * bf = new_bitfile(file, mode);
+
 	bf->buffer = xmalloc(BITFILE_BUFFER_LEN);
 	bf->buffer_end = bf->buffer + BITFILE_BUFFER_LEN;
 	memset(bf->buffer, 0, BITFILE_BUFFER_LEN);
 
 	bf->pos = bf->buffer;
 	bf->read_end = bf->buffer;
-	bf->bit_pos = 0;
 
-	if (*mode == 'r')
+	if (bf->mode == 'r')
 		read_buffer(bf);
 
-	assert (*mode == 'r' || *mode == 'w');
-
-	bf->mode = *mode;
-
 	return bf;
 }
 
@@ -126,12 +454,178 @@ struct bitfile * bitfile_open(char *filename, const char *mode)
 	return bitfile_from_file(file, mode);
 }
 
+struct bitfile * bitfile_open_mmap(char *filename)
+{
+	struct bitfile *bf;
+	struct stat st;
+	void *map;
+	FILE *file = fopen(filename, "rb");
+	if (file == NULL) {
+		error("Unable to open (mode: rb) file %s: %s",
+		      filename, strerror(errno));
+	}
+
+	/* Pipes, devices and empty files are read through the buffer */
+	if (fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode) ||
+	    st.st_size == 0 || (size_t)st.st_size != st.st_size)
+		return bitfile_from_file(file, "rb");
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+	if (map == MAP_FAILED)
+		return bitfile_from_file(file, "rb");
+
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	bf = new_bitfile(file, "rb");
+	bf->buffer = map;
+	bf->buffer_end = bf->buffer + st.st_size;
+	bf->pos = bf->buffer;
+	bf->read_end = bf->buffer_end;
+	bf->backend = BITFILE_MMAP;
+
+	return bf;
+}
+
+struct bitfile * bitfile_open_async(char *filename, const char *mode,
+				    size_t chunk_len)
+{
+	struct bitfile *bf;
+	struct bitfile_async *as;
+	int i;
+	FILE *file = fopen(filename, mode);
+	if (file == NULL) {
+		error("Unable to open (mode: %s) file %s: %s",
+		      mode, filename, strerror(errno));
+	}
+
+	/* The bit writer needs room for a whole word */
+	if (chunk_len < 8)
+		chunk_len = 8;
+
+	bf = new_bitfile(file, mode);
+	as = bf->async = xmalloc(sizeof(struct bitfile_async));
+
+	for (i=0; i<2; i++) {
+		as->bufs[i] = xmalloc(BITFILE_HEADROOM + chunk_len);
+		as->bufs[i] += BITFILE_HEADROOM;
+	}
+	as->chunk_len = chunk_len;
+	as->io_buf = NULL;
+	as->io_len = 0;
+	as->io_errno = 0;
+	as->busy = 0;
+	as->quit = 0;
+	as->eof = 0;
+
+	bf->buffer = as->bufs[0];
+	bf->buffer_end = bf->buffer + chunk_len;
+	memset(bf->buffer, 0, chunk_len);
+	bf->pos = bf->buffer;
+	bf->read_end = bf->buffer;
+
+	pthread_mutex_init(&as->lock, NULL);
+	pthread_cond_init(&as->cond, NULL);
+	if (pthread_create(&as->thread, NULL, async_thread, bf) != 0)
+		error("Unable to create I/O thread for file %s", filename);
+
+	if (bf->mode == 'r') {
+		async_submit(bf, async_other(bf), 0);
+		read_buffer(bf);
+	}
+
+	return bf;
+}
+
+struct bitfile * bitfile_from_memory(const u8 *data, size_t len)
+{
+	struct bitfile *bf = new_bitfile(NULL, "r");
+
+	bf->backend = BITFILE_MEMORY;
+	bf->buffer = (u8 *)data;
+	bf->buffer_end = bf->buffer + len;
+	bf->pos = bf->buffer;
+	bf->read_end = bf->buffer_end;
+
+	return bf;
+}
+
+struct bitfile * bitfile_to_memory(u8 *buf, size_t capacity)
+{
+	struct bitfile *bf = new_bitfile(NULL, "w");
+
+	bf->backend = BITFILE_MEMORY;
+	if (buf == NULL) {
+		if (capacity < BITFILE_BUFFER_LEN)
+			capacity = BITFILE_BUFFER_LEN;
+		buf = xmalloc(capacity);
+		bf->mem_grow = 1;
+	}
+
+	bf->mem = bf->buffer = buf;
+	bf->mem_len = capacity;
+	bf->buffer_end = bf->buffer + capacity;
+	bf->pos = bf->buffer;
+
+	/* No room at all, start counting right away */
+	if (capacity == 0)
+		memory_write_buffer(bf);
+
+	return bf;
+}
+
+u8 * bitfile_close_memory(struct bitfile *bf, size_t *len)
+{
+	u8 *mem;
+
+	assert(bf->backend == BITFILE_MEMORY && bf->mode == 'w');
+
+	/* Draining can grow the buffer and move it */
+	drain_acc(bf);
+	if (bf->bit_pos != 0) bf->pos++;
+	mem = bf->mem;
+
+	if (bf->buffer == bf->mem) {
+		*len = bf->pos - bf->buffer;
+	} else {
+		/* Ran out of the fixed-size buffer */
+		*len = bf->mem_len + bf->mem_lost + (bf->pos - bf->buffer);
+		xfree(bf->buffer);
+		if (*len > bf->mem_len)
+			mem = NULL;
+	}
+
+	xfree(bf);
+	return mem;
+}
+
 void bitfile_close(struct bitfile *bf)
 {
-	if (bf->mode == 'w') write_buffer(bf);
+	if (bf->backend == BITFILE_MEMORY) {
+		if (bf->mode == 'w') {
+			if (bf->buffer != bf->mem)
+				xfree(bf->buffer);
+			if (bf->mem_grow)
+				xfree(bf->mem);
+		}
+		xfree(bf);
+		return;
+	}
 
-	fclose(bf->file);
-	xfree(bf->buffer);
+	if (bf->mode == 'w') {
+		drain_acc(bf);
+		write_buffer(bf);
+	}
+
+	if (bf->async)
+		async_close(bf);
+
+	/* Buffered output may only fail to reach the file here */
+	if (fclose(bf->file) != 0 && bf->mode == 'w')
+		error("Unable to write file: %s", strerror(errno));
+	if (bf->backend == BITFILE_MMAP)
+		munmap(bf->buffer, bf->buffer_end - bf->buffer);
+	else
+		xfree(bf->buffer);
 	xfree(bf);
 }
 
@@ -139,6 +633,8 @@ void bitfile_put_byte(struct bitfile *bf, u8 byte)
 {
 	assert(bf->mode == 'w');
 
+	if (bf->acc_bits) drain_acc(bf);
+
 	if (bf->bit_pos == 0) {
 		*bf->pos++ = byte;
 		if (bf->pos >= bf->buffer_end) {
@@ -162,6 +658,23 @@ void bitfile_put_bytes(struct bitfile *bf, u8 *bytes, size_t count)
 {
 	assert(bf->mode == 'w');
 
+	if (bf->acc_bits) drain_acc(bf);
+
+	/* Byte aligned: copy as much as fits in the buffer at once */
+	while (bf->bit_pos == 0 && count > 0) {
+		size_t n = bf->buffer_end - bf->pos;
+
+		if (n > count)
+			n = count;
+		memcpy(bf->pos, bytes, n);
+		bf->pos += n;
+		bytes += n;
+		count -= n;
+
+		if (bf->pos >= bf->buffer_end)
+			write_buffer(bf);
+	}
+
 	while (count > 0) {
 		bitfile_put_byte(bf, *bytes++);
 		count--;
@@ -190,6 +703,12 @@ void bitfile_put_bit(struct bitfile *bf, u8 bit)
 	assert(bf->mode == 'w');
 	assert(bit == 0 || bit == 1);
 
+	if (bf->acc_bits) drain_acc(bf);
+
+	/* Start new bytes from zero, the buffer may hold anything */
+	if (bf->bit_pos == 0)
+		*bf->pos = 0;
+
 	if (bit)
 		BIT_SET(*bf->pos, bf->bit_pos);
 	else
@@ -205,39 +724,133 @@ void bitfile_put_bit(struct bitfile *bf, u8 bit)
 	}
 }
 
-int bitfile_get_bytes(struct bitfile *bf, u8 *res, size_t count)
+void bitfile_put_code(struct bitfile *bf, u64 code, int len)
 {
-	assert(bf->mode == 'r');
+	assert(bf->mode == 'w');
+	assert(len >= 0 && len <= 64);
 
-	while (count > 0) {
-		if (bitfile_get_byte(bf, res++) != 0) return -1;
-		count--;
+	/* Codes longer than what fits next to a partial byte are split */
+	if (len > 57) {
+		bitfile_put_code(bf, code >> 32, len - 32);
+		code &= 0xffffffffUL;
+		len = 32;
 	}
-	return 0;
+
+	/* Continue from the partial byte left by the bit and byte writers */
+	if (bf->bit_pos != 0) {
+		bf->acc = *bf->pos >> (8 - bf->bit_pos);
+		bf->acc_bits = bf->bit_pos;
+		bf->bit_pos = 0;
+	}
+
+	if (bf->acc_bits + len > 64)
+		flush_acc(bf);
+
+	bf->acc = (bf->acc << len) | code;
+	bf->acc_bits += len;
 }
 
-int bitfile_get_byte(struct bitfile *bf, u8 *res)
+size_t bitfile_read(struct bitfile *bf, u8 *res, size_t count)
 {
+	size_t done = 0;
+
 	assert(bf->mode == 'r');
 
-	if (bf->pos >= bf->read_end) return -1;
+	/* Byte aligned: empty the container, then copy straight from the
+	   buffer */
+	if ((bf->bitcount & 7) == 0) {
+		while (done < count && bf->bitcount > 0)
+			bitfile_get_byte(bf, &res[done++]);
+		if (done == count)
+			return done;
+
+		/* Bits read ahead are no longer the following ones */
+		bf->bitbuf = 0;
+		while (done < count) {
+			size_t n = bf->read_end - bf->pos;
+
+			if (n == 0) {
+				read_buffer(bf);
+				n = bf->read_end - bf->pos;
+				if (n == 0)
+					break;
+			}
+			if (n > count - done)
+				n = count - done;
+			memcpy(res + done, bf->pos, n);
+			bf->pos += n;
+			done += n;
+		}
+		return done;
+	}
 
-	if (bf->bit_pos == 0) {
-		*res = *bf->pos++;
-		if (bf->pos >= bf->read_end)
-			read_buffer(bf);
-	} else {
-		int left = bf->bit_pos;
-		*res = *bf->pos++ << left;
+	while (done < count && bitfile_get_byte(bf, &res[done]) == 0)
+		done++;
+	return done;
+}
 
-		if (bf->pos >= bf->read_end)
-			read_buffer(bf);
+int bitfile_get_bytes(struct bitfile *bf, u8 *res, size_t count)
+{
+	return bitfile_read(bf, res, count) == count ? 0 : -1;
+}
 
-		/* Did we get the rest of the byte? */
-		if (bf->pos >= bf->read_end) return -1;
+/* Refill near the end of the buffer; tops up the buffer and falls
+ * back to loading a byte at a time at the end of input */
+static int refill_slow(struct bitfile *bf)
+{
+	if (bf->read_end - bf->pos < 8)
+		read_buffer(bf);
+
+	if (bf->pos + 8 <= bf->read_end)
+		return bitfile_refill_bits(bf);
 
-		*res |= *bf->pos >> left;
+	while (bf->bitcount < 56 && bf->pos < bf->read_end) {
+		bf->bitbuf |= (u64)*bf->pos++ << (56 - bf->bitcount);
+		bf->bitcount += 8;
 	}
+	return bf->bitcount;
+}
+
+int bitfile_refill_bits(struct bitfile *bf)
+{
+	assert(bf->mode == 'r');
+
+	if (bf->pos + 8 > bf->read_end)
+		return refill_slow(bf);
+
+	/* Load a whole word and advance over the bytes that fit in */
+	bf->bitbuf |= LOAD_BE64(bf->pos) >> bf->bitcount;
+	bf->pos += (63 - bf->bitcount) >> 3;
+	bf->bitcount |= 56;
+
+	return bf->bitcount;
+}
+
+u64 bitfile_peek_bits(struct bitfile *bf, int count)
+{
+	assert(count > 0 && count <= 56);
+
+	return bf->bitbuf >> (64 - count);
+}
+
+void bitfile_consume_bits(struct bitfile *bf, int count)
+{
+	assert(count >= 0 && count <= bf->bitcount);
+
+	bf->bitbuf <<= count;
+	bf->bitcount -= count;
+}
+
+int bitfile_get_byte(struct bitfile *bf, u8 *res)
+{
+	assert(bf->mode == 'r');
+
+	if (bf->bitcount < 8 && bitfile_refill_bits(bf) < 8)
+		return -1;
+
+	*res = (u8)(bf->bitbuf >> 56);
+	bf->bitbuf <<= 8;
+	bf->bitcount -= 8;
 	return 0;
 }
 
@@ -245,16 +858,12 @@ int bitfile_get_bit(struct bitfile *bf, u8 *res)
 {
 	assert(bf->mode == 'r');
 
-	if (bf->pos >= bf->read_end) return -1;
+	if (bf->bitcount < 1 && bitfile_refill_bits(bf) < 1)
+		return -1;
 
-	*res = (*bf->pos & (1<<(7-bf->bit_pos++))) != 0;
-	if (bf->bit_pos > 7) {
-		bf->bit_pos = 0;
-		bf->pos++;
-		if (bf->pos >= bf->read_end) {
-			read_buffer(bf);
-		}
-	}
+	*res = (u8)(bf->bitbuf >> 63);
+	bf->bitbuf <<= 1;
+	bf->bitcount--;
 	return 0;
 }
 
@@ -308,10 +917,77 @@ int bitfile_get_u32(struct bitfile *bf, u32 *res)
 	return 0;
 }
 
-void bitfile_rewind(struct bitfile *bf)
+void bitfile_align(struct bitfile *bf)
+{
+	if (bf->mode == 'r') {
+		bitfile_consume_bits(bf, bf->bitcount & 7);
+		return;
+	}
+
+	if (bf->acc_bits) drain_acc(bf);
+
+	if (bf->bit_pos != 0) {
+		bf->bit_pos = 0;
+		if (++bf->pos >= bf->buffer_end)
+			write_buffer(bf);
+	}
+}
+
+void bitfile_seek(struct bitfile *bf, u64 offset)
 {
 	assert(bf->mode == 'r');
 
-	bf->bit_pos = 0;
-	bf->pos = bf->buffer;
+	bf->bitbuf = 0;
+	bf->bitcount = 0;
+
+	/* The whole input, or the start of the file up to 'offset', is
+	   already buffered */
+	if (bf->backend != BITFILE_FILE || !bf->dropped) {
+		if (offset <= (u64)(bf->read_end - bf->buffer)) {
+			bf->pos = bf->buffer + offset;
+			return;
+		}
+		if (bf->backend != BITFILE_FILE) {
+			bf->pos = bf->read_end;
+			return;
+		}
+	}
+
+	if (bf->async) {
+		/* Let the read ahead finish before moving the file position */
+		async_wait(bf);
+		bf->async->eof = 0;
+	}
+
+	if (fseeko(bf->file, offset, SEEK_SET) != 0)
+		error("Unable to seek file: %s", strerror(errno));
+
+	bf->pos = bf->read_end = bf->buffer;
+	bf->dropped = offset != 0;
+
+	if (bf->async)
+		async_submit(bf, async_other(bf), 0);
+	read_buffer(bf);
+}
+
+int bitfile_size(struct bitfile *bf, u64 *size)
+{
+	struct stat st;
+
+	assert(bf->mode == 'r');
+
+	if (bf->backend != BITFILE_FILE) {
+		*size = bf->buffer_end - bf->buffer;
+		return 0;
+	}
+
+	if (fstat(fileno(bf->file), &st) != 0 || !S_ISREG(st.st_mode))
+		return 1;
+	*size = st.st_size;
+	return 0;
+}
+
+void bitfile_rewind(struct bitfile *bf)
+{
+	bitfile_seek(bf, 0);
 }
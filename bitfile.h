@@ -12,15 +12,60 @@ struct bitfile;
 /* Open a bitfile from filename */
 struct bitfile * bitfile_open(char *filename, const char *mode);
 
+/* Open a bitfile for reading with the file mapped into memory, so that
+ * reading and rewinding need no copying. Files that cannot be mapped
+ * (pipes, devices, empty files) are read as with bitfile_open(). */
+struct bitfile * bitfile_open_mmap(char *filename);
+
+/* Open a bitfile doing its I/O asynchronously in a helper thread in
+ * chunks of 'chunk_len' bytes. When reading, the next chunk is read ahead
+ * while the current one is being used; when writing, the previous chunk
+ * is written out while the next one is being filled. */
+struct bitfile * bitfile_open_async(char *filename, const char *mode,
+				    size_t chunk_len);
+
 /* Open a bitfile from already opened file */
 struct bitfile * bitfile_from_file(FILE *file, const char *mode);
 
-/* Close a bitfile */
+/* Open a bitfile for reading 'len' bytes at 'data' in place. The data
+ * must stay around until the bitfile is closed. */
+struct bitfile * bitfile_from_memory(const u8 *data, size_t len);
+
+/* Open a bitfile for writing into memory. With 'buf' NULL the output
+ * goes into a buffer that grows as needed ('capacity' is the initial
+ * size, 0 for default); otherwise into 'buf' of 'capacity' bytes.
+ * Get the output with bitfile_close_memory(). */
+struct bitfile * bitfile_to_memory(u8 *buf, size_t capacity);
+
+/* Close a bitfile opened with bitfile_to_memory() and return the buffer
+ * holding the output, storing the output length into 'len'. A buffer
+ * allocated by bitfile is to be freed with xfree(). If the output did
+ * not fit into the caller's buffer, returns NULL with 'len' set to the
+ * size that would have been needed. */
+u8 * bitfile_close_memory(struct bitfile *bf, size_t *len);
+
+/* Close a bitfile. Output still buffered is written; a write error
+ * is fatal. */
 void bitfile_close(struct bitfile *bf);
 
-/* Rewind a bitfile to start. Only works when opened for reading */
+/* Rewind a bitfile to start. Only works when opened for reading.
+ * Only a fixed-size window of the input is kept in memory, so once the
+ * window has moved past the start this seeks the underlying file, which
+ * then must be seekable (failure -> call error()). */
 void bitfile_rewind(struct bitfile *bf);
 
+/* Move to byte 'offset' of the input, as bitfile_rewind() does to the
+ * start. Reading past the end of input after seeking there gives EOF. */
+void bitfile_seek(struct bitfile *bf, u64 offset);
+
+/* Store the size of the input in bytes into 'size'. Returns non-zero if
+ * the size is not known (pipes, devices). */
+int bitfile_size(struct bitfile *bf, u64 *size);
+
+/* Move to the next byte boundary: writing pads with zero bits, reading
+ * skips the rest of the current byte. */
+void bitfile_align(struct bitfile *bf);
+
 /* Write things into the file (failure -> call error()) */
 void bitfile_put_byte(struct bitfile *bf, u8 byte);
 void bitfile_put_bytes(struct bitfile *bf, u8 *bytes, size_t count);
@@ -28,10 +73,29 @@ void bitfile_put_bit(struct bitfile *bf, u8 bit);
 void bitfile_put_bits(struct bitfile *bf, u8 *bits, size_t count);
 void bitfile_put_u32(struct bitfile *bf, u32 data);
 
+/* Write the low 'len' (at most 64) bits of 'code', most significant
+ * bit first. The other bits of 'code' must be zero. Codes are collected
+ * into a 64-bit accumulator that is flushed a word at a time. */
+void bitfile_put_code(struct bitfile *bf, u64 code, int len);
+
 /* Read things from the file. Returns non-zero if EOF. */
 int bitfile_get_byte(struct bitfile *bf, u8 *res);
 int bitfile_get_bytes(struct bitfile *bf, u8 *res, size_t count);
 int bitfile_get_bit(struct bitfile *bf, u8 *res);
 int bitfile_get_u32(struct bitfile *bf, u32 *res);
 
+/* Read up to 'count' bytes into 'res'. Returns the number of bytes
+ * read, less than 'count' only at the end of input. */
+size_t bitfile_read(struct bitfile *bf, u8 *res, size_t count);
+
+/* Read bits through a 64-bit container, for decoders looking at many
+ * bits at once. bitfile_refill_bits() returns the number of bits in the
+ * container, at least 56 unless near the end of input. Up to that many
+ * bits can then be looked at with bitfile_peek_bits() (1-56 bits; bits
+ * past the end of input read as zero) and dropped with
+ * bitfile_consume_bits() without further checks. */
+int bitfile_refill_bits(struct bitfile *bf);
+u64 bitfile_peek_bits(struct bitfile *bf, int count);
+void bitfile_consume_bits(struct bitfile *bf, int count);
+
 #endif /* __BITFILE_H */
@@ -0,0 +1,1860 @@
+/*
+ * hcpak.c - huffman's code compression of bitfiles
+ *
+ * Copyright (C) 2008 Jussi Mäki <joamaki@gmail.com>
+ *
+ * == File format ==
+ * - Magic (5 bytes): HCPA followed by the format version, 'K' for the
+ *                    original version 1, '2' for version 2 and '3' for
+ *                    version 3.
+ *
+ * Version 1:
+ * - Frequency/Character table len: 8-bit integer. This is 1 less then true
+ *                                  length so it can be stored in 8-bit integer.
+ *                                  This also means that we cannot compress empty
+ *                                  files.
+ * - Frequency/Character table: [{char, freq}, ...]; each entry is 1+4 bytes,
+ *                              full alphabet being 256*5 = 1280 bytes.
+ *                              The decoder rebuilds the tree with huffman().
+ * - Data ...
+ * - EOF marked by EOFCHAR (code depends on Huffman's)
+ *
+ * Version 2:
+ * - Flags: 8-bit integer, one of FLAG_STREAMS, FLAG_ADAPTIVE, FLAG_STORED
+ *   and FLAG_DICT or 0.
+ * - With FLAG_STREAMS, number of substreams (2-HCPAK_MAX_STREAMS): 8-bit
+ *   integer.
+ * - Code length table (see write_lengths()) of canonical codes for the
+ *   257 symbols (256 chars + EOFCHAR), packed at bit level. Codes are
+ *   limited to HCPAK_MAX_CODE_LEN bits.
+ * - Without FLAG_STREAMS:
+ *   - Data, right after the table ...
+ *   - EOF marked by EOFCHAR
+ * - With FLAG_STREAMS, from the next byte boundary, regions of up to
+ *   REGION_LEN input bytes:
+ *   - Number of bytes in the region: 32-bit integer, 0 ends the data.
+ *   - Jump table: length in bytes of each substream, 32-bit integers.
+ *   - The substreams one after another. Byte i of the region is coded
+ *     in substream i % streams, each substream padded to whole bytes.
+ *     There is no EOFCHAR.
+ * - With FLAG_ADAPTIVE, no code length table: the data follows the
+ *   flags right away, coded with the adaptive Huffman code of
+ *   adaptive.c, and ends with EOFCHAR.
+ * - With FLAG_STORED, no code length table: the data follows the flags
+ *   as it is, up to the end of the file.
+ * - With FLAG_DICT, no code length table but the 32-bit ID of the
+ *   trained dictionary holding it. The data follows as without
+ *   FLAG_STREAMS.
+ *
+ * Version 3, coded in independent blocks:
+ * - Flags: 8-bit integer, FLAG_INDEX or 0.
+ * - Block length: 32-bit integer, input bytes per block.
+ * - Blocks, each of the block length except for the last:
+ *   - Number of bytes in the block: 32-bit integer, 0 ends the data.
+ *   - Compressed length: 32-bit integer, bytes of the rest of the block.
+ *   - Number of substreams (1-HCPAK_MAX_STREAMS): 8-bit integer. 0 for a
+ *     stored block, where the data follows as it is. BLOCK_CONTEXT for
+ *     a context block, laid out as described below.
+ *   - Jump table: length in bytes of each substream, 32-bit integers.
+ *   - Code length table (see write_lengths()) of the block, padded to
+ *     whole bytes. EOFCHAR has no code.
+ *   - The substreams one after another, as in the regions of version 2.
+ * - A context block codes each byte with one of up to CONTEXT_TABLES
+ *   codes, chosen by the byte before it (0 for the first byte):
+ *   - Length of the coded data in bytes: 32-bit integer.
+ *   - Number of codes: 8-bit integer.
+ *   - Code of each previous byte value: 4-bit integers, high bits first.
+ *   - Code length table of each code, packed one after another and
+ *     padded to whole bytes after the last.
+ *   - The coded data.
+ * - With FLAG_INDEX, a seek index after the empty block:
+ *   - Offset from the start of the file of each block: 64-bit integers.
+ *     Block i holds the input from i times the block length on.
+ *   - Number of blocks: 32-bit integer, last in the file.
+ * Dictionary table file (see hcpak_dict_save()):
+ * - Magic (5 bytes): HCPAD.
+ * - ID: 32-bit integer, a hash of the code lengths.
+ * - Code length table of the 257 symbols, as in version 2. All of them
+ *   have a code.
+ * All integers are stored most significant byte first.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "huffman.h"
+#include "adaptive.h"
+#include "bitfile.h"
+#include "hcpak.h"
+
+/* File magic, followed by the version */
+#define MAGIC_LEN 5
+static const u8 *magic = (u8*) "HCPA";
+#define VERSION_1 'K'
+#define VERSION_2 '2'
+#define VERSION_3 '3'
+
+/* Dictionary table file magic */
+static const u8 *dict_magic = (u8*) "HCPAD";
+
+/* Maximum character count */
+#define MAX_CHARS 257
+
+/* Character for representing EOF for the file. Version 1 files do not
+   store it, it just comes last in the frequency table. */
+#define EOFCHAR 256
+
+/* Version 2 flags */
+#define FLAG_STREAMS 0x01  /* Data split into interleaved substreams */
+#define FLAG_ADAPTIVE 0x02 /* Adaptive code, no code length table */
+#define FLAG_STORED 0x08   /* Data stored as it is */
+#define FLAG_DICT 0x10     /* Code of a trained dictionary */
+
+/* Version 3 flags */
+#define FLAG_INDEX 0x04    /* Seek index after the blocks */
+
+/* Input bytes per region of interleaved substreams */
+#define REGION_LEN (256*1024)
+
+#if HCPAK_MAX_STREAMS > HC_MAX_STREAMS
+#error "More streams than huffman_decode_streams() takes"
+#endif
+
+/* Data is stored rather than coded unless coding saves at least
+   1/STORED_MIN_GAIN of it */
+#define STORED_MIN_GAIN 64
+
+/* Shorter inputs are written as a single stream */
+#define STREAMS_MIN_LEN 4096
+
+/* Longest code length table */
+#define TABLE_MAX_LEN (1 + (MAX_CHARS * (7 + 8) + 7) / 8)
+
+/* Most bytes a block of 'len' input bytes takes after its lengths */
+#define BLOCK_MAX_PACKED(len) \
+	(1 + HCPAK_MAX_STREAMS * (4 + 1) + TABLE_MAX_LEN + \
+	 (len) / 8 * HCPAK_MAX_CODE_LEN + HCPAK_MAX_CODE_LEN)
+
+/* Context blocks: the substream count byte marking them, the most
+   codes, rounds of clustering the contexts into codes, and the bytes
+   of the header after the block lengths */
+#define BLOCK_CONTEXT 0x80
+#define CONTEXT_TABLES 16
+#define CONTEXT_ROUNDS 4
+#define CONTEXT_HEAD_LEN (1 + 4 + 1 + 256/2)
+
+/* Shorter blocks are not worth the context tables */
+#define CONTEXT_MIN_LEN (16*1024)
+
+/* Average symbols per lookup for which the multi-symbol table is used */
+#define MULTI_MIN_SYMS 1.5
+
+/* A trained code with its decoder */
+struct hcpak_dict {
+	u32 id;
+	u8 lens[MAX_CHARS];
+	struct hccode codes[MAX_CHARS];
+	struct hcdecoder *dec; /* Built once, then only read */
+	int multi;             /* Non-zero if 'dec' has a multi-symbol
+				  table, which every decoding path uses */
+};
+
+/* Bytes counted at a time by calculate_frequencies() */
+#define COUNT_CHUNK_LEN (64*1024)
+
+/* Bytes handed to a thread at a time by count_frequencies_parallel() */
+#define PARALLEL_COUNT_LEN (1024*1024)
+
+/* With the sample option, frequencies are estimated from this many
+   windows spread evenly over the input, of SAMPLE_LEN bytes for a
+   single code and SAMPLE_BLOCK_LEN bytes for a block */
+#define SAMPLE_WINDOWS 16
+#define SAMPLE_LEN (64*1024)
+#define SAMPLE_BLOCK_LEN 4096
+
+/* Shortest code length limit with the sample option. Every byte gets a
+   code in case it occurs, and under a short limit the unseen bytes
+   would take a large share of the code space. */
+#define SAMPLE_MIN_CODE_LEN 16
+
+static void calculate_frequencies (struct bitfile *bf, u64 *freqs)
+{
+	u8 *chunk = xmalloc(COUNT_CHUNK_LEN);
+	size_t len;
+
+	memset(freqs, 0, MAX_CHARS * sizeof(u64));
+
+	do {
+		len = bitfile_read(bf, chunk, COUNT_CHUNK_LEN);
+		huffman_count(chunk, len, freqs);
+	} while (len == COUNT_CHUNK_LEN);
+
+	xfree(chunk);
+}
+
+static void count_frequencies(const u8 *data, size_t len, u64 *freqs)
+{
+	memset(freqs, 0, MAX_CHARS * sizeof(u64));
+	huffman_count(data, len, freqs);
+}
+
+/* Limit on code lengths for 'opts' */
+static int code_len_limit(const struct hcpak_options *opts)
+{
+	if (opts->sample && opts->max_code_len < SAMPLE_MIN_CODE_LEN)
+		return SAMPLE_MIN_CODE_LEN;
+	return opts->max_code_len;
+}
+
+/* Estimated bytes of 'len' bytes coded with frequencies 'freqs'
+   (counted or sampled) and code lengths 'lens' */
+static double coded_len(const u64 freqs[], const u8 lens[], u64 len)
+{
+	double bits = 0, total = 0;
+	int c;
+
+	for (c=0; c<MAX_CHARS; c++) {
+		bits += (double)freqs[c] * lens[c];
+		total += freqs[c];
+	}
+	if (total == 0)
+		return len;
+
+	return bits / total * len / 8;
+}
+
+/* Non-zero if coding 'len' bytes with frequencies 'freqs' and code
+   lengths 'lens' is estimated to save enough over storing them, with
+   'extra' more bytes of tables than stored */
+static int worth_coding(const u64 freqs[], const u8 lens[], u64 len,
+			u64 extra)
+{
+	return coded_len(freqs, lens, len) + extra <
+		len - len / STORED_MIN_GAIN;
+}
+
+/* Bytes missed by sampling may still occur, so all get a code */
+static void count_unsampled(u64 *freqs)
+{
+	int c;
+
+	for (c=0; c<256; c++)
+		freqs[c]++;
+}
+
+/* Estimate the frequencies of the 'size' bytes of 'bf' from
+   SAMPLE_WINDOWS windows, each in the middle of its share of the input.
+   The input must be longer than the windows. */
+static void sample_frequencies(struct bitfile *bf, u64 size, u64 *freqs)
+{
+	u8 *window = xmalloc(SAMPLE_LEN);
+	u64 step = size / SAMPLE_WINDOWS;
+	size_t len;
+	int i;
+
+	memset(freqs, 0, MAX_CHARS * sizeof(u64));
+
+	for (i=0; i<SAMPLE_WINDOWS; i++) {
+		bitfile_seek(bf, i * step + (step - SAMPLE_LEN) / 2);
+		len = bitfile_read(bf, window, SAMPLE_LEN);
+		huffman_count(window, len, freqs);
+	}
+	count_unsampled(freqs);
+
+	xfree(window);
+}
+
+/* Estimate the frequencies of 'len' bytes at 'data' as
+   sample_frequencies() does, counting short inputs in full */
+static void sample_block(const u8 *data, size_t len, u64 *freqs)
+{
+	size_t step = len / SAMPLE_WINDOWS;
+	int i;
+
+	if (len <= SAMPLE_WINDOWS * SAMPLE_BLOCK_LEN) {
+		count_frequencies(data, len, freqs);
+		return;
+	}
+
+	memset(freqs, 0, MAX_CHARS * sizeof(u64));
+	for (i=0; i<SAMPLE_WINDOWS; i++)
+		huffman_count(data + i * step + (step - SAMPLE_BLOCK_LEN) / 2,
+			      SAMPLE_BLOCK_LEN, freqs);
+	count_unsampled(freqs);
+}
+
+/* Integer stored most significant byte first */
+static u32 load_be32(const u8 *p)
+{
+	return (u32)p[0] << 24 | (u32)p[1] << 16 | (u32)p[2] << 8 | p[3];
+}
+
+/* Read 'count' (1-32) bits. Returns non-zero if EOF. */
+static int get_bits(struct bitfile *bf, int count, u32 *res)
+{
+	if (bitfile_refill_bits(bf) < count)
+		return -1;
+
+	*res = (u32)bitfile_peek_bits(bf, count);
+	bitfile_consume_bits(bf, count);
+	return 0;
+}
+
+/* Write the code length table: the number of bits per length as 8-bit
+   integer, then the length of each symbol in that many bits. A zero
+   length is followed by an 8-bit count of further zero lengths. */
+static void write_lengths(struct bitfile *bf, const u8 lens[])
+{
+	int i, max = 0, bits = 0;
+
+	for (i=0; i<MAX_CHARS; i++)
+		if (lens[i] > max)
+			max = lens[i];
+	while ((1 << bits) <= max)
+		bits++;
+
+	bitfile_put_byte(bf, bits);
+
+	for (i=0; i<MAX_CHARS; i++) {
+		bitfile_put_code(bf, lens[i], bits);
+
+		if (lens[i] == 0) {
+			int run = 0;
+
+			while (i+1 < MAX_CHARS && lens[i+1] == 0 && run < 255) {
+				run++;
+				i++;
+			}
+			bitfile_put_code(bf, run, 8);
+		}
+	}
+}
+
+static void read_lengths(struct bitfile *bf, u8 lens[])
+{
+	u8 bits;
+	u32 len, run;
+	int i;
+
+	if (bitfile_get_byte(bf, &bits) != 0)
+		error("Input too short!");
+	if (bits < 1 || bits > 7)
+		error("Invalid code length table!");
+
+	for (i=0; i<MAX_CHARS; i++) {
+		if (get_bits(bf, bits, &len) != 0)
+			error("Input too short!");
+		lens[i] = len;
+
+		if (len == 0) {
+			if (get_bits(bf, 8, &run) != 0)
+				error("Input too short!");
+			if (i + run >= MAX_CHARS)
+				error("Invalid code length table!");
+			while (run-- > 0)
+				lens[++i] = 0;
+		}
+	}
+}
+
+/* Read the frequency table of a version 1 file and rebuild its codes */
+static void read_freq_table(struct bitfile *bf, struct hccode codes[])
+{
+	u32 freqs[MAX_CHARS];
+	int chars[MAX_CHARS];
+	int freqtable_len = 0;
+	struct hctree *tree;
+	int i;
+	u8 byte;
+
+	/* Get frequency table length */
+	if (bitfile_get_byte(bf, &byte) != 0)
+		error("Input too short!");
+
+	/* NB: Frequency table length is stored as 1 less then true length so that we
+	   can store the length 256 in 8-bit integer (range 0-255). */
+	freqtable_len = byte + 1;
+
+	/* Get frequency table */
+	for (i=0; i<freqtable_len; i++) {
+		if (bitfile_get_byte(bf, &byte) != 0)
+			error("Input too short!");
+
+		chars[i] = byte;
+		if (bitfile_get_u32(bf, &freqs[i]) != 0)
+			error("Input too short!");
+	}
+
+	freqs[freqtable_len] = 1;
+	chars[freqtable_len] = EOFCHAR;
+	freqtable_len++;
+
+	tree = huffman_new();
+	huffman_init(tree, freqs, chars, freqtable_len);
+	huffman(tree);
+	huffman_code_table(tree, codes);
+	huffman_free(tree);
+}
+
+void hcpak_default_options(struct hcpak_options *opts)
+{
+	opts->max_code_len = HCPAK_DEFAULT_CODE_LEN;
+	opts->streams = HCPAK_DEFAULT_STREAMS;
+	opts->adaptive = 0;
+	opts->block_len = HCPAK_DEFAULT_BLOCK_LEN;
+	opts->threads = 1;
+	opts->index = 0;
+	opts->sample = 0;
+	opts->dict = NULL;
+	opts->context = 0;
+}
+
+/* Copy the rest of 'in' to 'out' as it is */
+static void copy_stored(struct bitfile *in, struct bitfile *out,
+			struct hcpak_stats *stats)
+{
+	u8 *chunk = xmalloc(COUNT_CHUNK_LEN);
+	size_t len;
+
+	do {
+		len = bitfile_read(in, chunk, COUNT_CHUNK_LEN);
+		bitfile_put_bytes(out, chunk, len);
+		stats->in_bits += 8.0 * len;
+		stats->out_bits += 8.0 * len;
+	} while (len == COUNT_CHUNK_LEN);
+
+	xfree(chunk);
+}
+
+/* Code 'in' in a single pass with an adaptive code */
+static void compress_adaptive(struct bitfile *in, struct bitfile *out,
+			      struct hcpak_stats *stats)
+{
+	struct hcadaptive *a = adaptive_new();
+	u8 byte;
+
+	while(bitfile_get_byte(in, &byte) == 0) {
+		stats->out_bits += adaptive_encode(a, out, byte);
+		stats->in_bits += 8;
+	}
+
+	adaptive_encode(a, out, EOFCHAR);
+	adaptive_free(a);
+}
+
+/* Code all of 'in' as one stream ended by EOFCHAR */
+static void compress_stream(struct bitfile *in, struct bitfile *out,
+			    const struct hccode codes[],
+			    struct hcpak_stats *stats)
+{
+	u8 byte;
+
+	while(bitfile_get_byte(in, &byte) == 0) {
+		bitfile_put_code(out, codes[byte].bits, codes[byte].len);
+		stats->in_bits += 8;
+		stats->out_bits += codes[byte].len;
+	}
+
+	/* Write pseudo-EOF marker */
+	bitfile_put_code(out, codes[EOFCHAR].bits, codes[EOFCHAR].len);
+}
+
+/* Code 'in' a region at a time into 'count' interleaved substreams */
+static void compress_streams(struct bitfile *in, struct bitfile *out,
+			     const struct hccode codes[], int count,
+			     struct hcpak_stats *stats)
+{
+	/* Every code fits in 32 bits */
+	size_t cap = (REGION_LEN / count + 1) * 4 + 8;
+	u8 *region = xmalloc(REGION_LEN);
+	u8 *bufs[HC_MAX_STREAMS];
+	u8 *data[HC_MAX_STREAMS];
+	size_t lens[HC_MAX_STREAMS];
+	size_t n, i;
+	int k;
+
+	for (k=0; k<count; k++)
+		bufs[k] = xmalloc(cap);
+
+	bitfile_align(out);
+
+	while (1) {
+		struct bitfile *sub[HC_MAX_STREAMS];
+
+		for (n=0; n<REGION_LEN; n++)
+			if (bitfile_get_byte(in, &region[n]) != 0)
+				break;
+		if (n == 0)
+			break;
+
+		for (k=0; k<count; k++)
+			sub[k] = bitfile_to_memory(bufs[k], cap);
+		for (i=0; i<n; i++) {
+			const struct hccode *c = &codes[region[i]];
+			bitfile_put_code(sub[i % count], c->bits, c->len);
+		}
+		for (k=0; k<count; k++)
+			data[k] = bitfile_close_memory(sub[k], &lens[k]);
+
+		/* Jump table, then the substreams one after another */
+		bitfile_put_u32(out, n);
+		for (k=0; k<count; k++)
+			bitfile_put_u32(out, lens[k]);
+		for (k=0; k<count; k++) {
+			bitfile_put_bytes(out, data[k], lens[k]);
+			stats->out_bits += 8.0 * lens[k];
+		}
+		stats->in_bits += 8.0 * n;
+	}
+
+	/* An empty region ends the data */
+	bitfile_put_u32(out, 0);
+
+	for (k=0; k<count; k++)
+		xfree(bufs[k]);
+	xfree(region);
+}
+
+/* Write 'len' bytes at 'data' as a stored version 3 block. Returns the
+   number of bytes written. */
+static size_t store_block(struct bitfile *out, const u8 *data, size_t len,
+			  struct hcpak_stats *stats)
+{
+	bitfile_put_u32(out, len);
+	bitfile_put_u32(out, 1 + len);
+	bitfile_put_byte(out, 0);
+	bitfile_put_bytes(out, (u8 *)data, len);
+
+	stats->in_bits += 8.0 * len;
+	stats->out_bits += 8.0 * (1 + len + 8);
+	return 1 + len + 8;
+}
+
+/* Cluster the contexts of 'hist', the counts of each byte after each
+   byte value, into up to CONTEXT_TABLES codes: 'map' gets the code of
+   each context, 'lens' the code lengths. Returns the number of codes. */
+static int cluster_contexts(u32 hist[][256], u8 map[],
+			    u8 lens[][MAX_CHARS], int max_len)
+{
+	u64 totals[256], freqs[MAX_CHARS], cost, best_cost;
+	u8 seed[256];
+	int remap[CONTEXT_TABLES];
+	int count = 0, round, best, j, k, c;
+
+	memset(map, 0, 256);
+	memset(seed, 0, sizeof(seed));
+	for (j=0; j<256; j++)
+		for (c=0, totals[j]=0; c<256; c++)
+			totals[j] += hist[j][c];
+
+	/* The busiest contexts start a code each */
+	for (count=0; count<CONTEXT_TABLES; count++) {
+		best = -1;
+		for (j=0; j<256; j++)
+			if (!seed[j] && totals[j] &&
+			    (best < 0 || totals[j] > totals[best]))
+				best = j;
+		if (best < 0)
+			break;
+		seed[best] = 1;
+		map[best] = count;
+	}
+	if (count == 0)
+		return 1;
+
+	for (round=0; round<=CONTEXT_ROUNDS; round++) {
+		/* Codes for the contexts as now clustered, the first round
+		   only for the contexts starting them */
+		for (k=0; k<count; k++) {
+			memset(freqs, 0, sizeof(freqs));
+			for (j=0; j<256; j++)
+				if (map[j] == k && (round || seed[j]))
+					for (c=0; c<256; c++)
+						freqs[c] += hist[j][c];
+			huffman_lengths(freqs, MAX_CHARS, lens[k]);
+			huffman_limit_lengths(lens[k], MAX_CHARS, max_len);
+		}
+		if (round == CONTEXT_ROUNDS)
+			break;
+
+		/* Move each context to the code coding it shortest; a byte
+		   without a code costs as if it had a long one */
+		for (j=0; j<256; j++) {
+			if (!totals[j])
+				continue;
+			best = 0;
+			best_cost = 0;
+			for (k=0; k<count; k++) {
+				for (c=0, cost=0; c<256; c++)
+					cost += (u64)hist[j][c] *
+						(lens[k][c] ? lens[k][c] :
+						 2 * max_len);
+				if (k == 0 || cost < best_cost) {
+					best = k;
+					best_cost = cost;
+				}
+			}
+			map[j] = best;
+		}
+	}
+
+	/* Drop the codes no context ended up with */
+	for (k=0; k<count; k++)
+		remap[k] = -1;
+	for (j=0; j<256; j++)
+		if (totals[j])
+			remap[map[j]] = 0;
+	for (k=0, c=0; k<count; k++) {
+		if (remap[k] < 0)
+			continue;
+		remap[k] = c;
+		memmove(lens[c++], lens[k], MAX_CHARS);
+	}
+	for (j=0; j<256; j++)
+		map[j] = totals[j] ? remap[map[j]] : 0;
+
+	return c;
+}
+
+/* Code 'len' bytes at 'data' as a context block, if that takes less
+   than 'limit' bytes. Returns the number of bytes written, 0 if none. */
+static size_t compress_context(struct bitfile *out, const u8 *data,
+			       size_t len, const struct hcpak_options *opts,
+			       double limit, struct hcpak_stats *stats)
+{
+	u32 (*hist)[256] = xmalloc(256 * sizeof(*hist));
+	u8 (*lens)[MAX_CHARS] = xmalloc(CONTEXT_TABLES * sizeof(*lens));
+	struct hccode (*codes)[MAX_CHARS];
+	u8 *tables = xmalloc(CONTEXT_TABLES * TABLE_MAX_LEN);
+	u8 map[256], prev;
+	struct bitfile *bf;
+	size_t tables_len, packed = 0, i;
+	u64 bits = 0;
+	int count, j, k, c;
+
+	memset(hist, 0, 256 * sizeof(*hist));
+	for (i=0, prev=0; i<len; prev=data[i++])
+		hist[prev][data[i]]++;
+
+	count = cluster_contexts(hist, map, lens, code_len_limit(opts));
+
+	/* The clustered codes cover every byte seen in their contexts */
+	for (j=0; j<256; j++)
+		for (c=0; c<256; c++)
+			bits += (u64)hist[j][c] * lens[map[j]][c];
+
+	bf = bitfile_to_memory(tables, CONTEXT_TABLES * TABLE_MAX_LEN);
+	for (k=0; k<count; k++)
+		write_lengths(bf, lens[k]);
+	bitfile_close_memory(bf, &tables_len);
+
+	if (CONTEXT_HEAD_LEN + tables_len + (bits + 7) / 8 < limit) {
+		packed = CONTEXT_HEAD_LEN + tables_len + (bits + 7) / 8;
+		codes = xmalloc(count * sizeof(*codes));
+		for (k=0; k<count; k++) {
+			memset(codes[k], 0, sizeof(codes[k]));
+			huffman_canonical_codes(lens[k], MAX_CHARS, codes[k]);
+		}
+
+		bitfile_put_u32(out, len);
+		bitfile_put_u32(out, packed);
+		bitfile_put_byte(out, BLOCK_CONTEXT);
+		bitfile_put_u32(out, (bits + 7) / 8);
+		bitfile_put_byte(out, count);
+		for (j=0; j<256; j+=2)
+			bitfile_put_byte(out, map[j] << 4 | map[j+1]);
+		bitfile_put_bytes(out, tables, tables_len);
+
+		for (i=0, prev=0; i<len; prev=data[i++]) {
+			const struct hccode *code = &codes[map[prev]][data[i]];
+			bitfile_put_code(out, code->bits, code->len);
+		}
+		bitfile_align(out);
+
+		stats->in_bits += 8.0 * len;
+		stats->out_bits += 8.0 * (packed + 8);
+		packed += 8;
+		xfree(codes);
+	}
+
+	xfree(tables);
+	xfree(lens);
+	xfree(hist);
+	return packed;
+}
+
+/* Code 'len' bytes at 'data' as a version 3 block with its own code.
+   Returns the number of bytes written. */
+static size_t compress_block(struct bitfile *out, const u8 *data, size_t len,
+			   const struct hcpak_options *opts,
+			   struct hcpak_stats *stats)
+{
+	u64 freqs[MAX_CHARS];
+	struct hccode codes[MAX_CHARS];
+	u8 lens[MAX_CHARS];
+	u8 table[TABLE_MAX_LEN];
+	u64 bits[HC_MAX_STREAMS];
+	size_t table_len, packed, i;
+	struct bitfile *bf;
+	int k, streams;
+
+	streams = len < STREAMS_MIN_LEN ? 1 : opts->streams;
+
+	if (opts->sample)
+		sample_block(data, len, freqs);
+	else
+		count_frequencies(data, len, freqs);
+	huffman_lengths(freqs, MAX_CHARS, lens);
+	huffman_limit_lengths(lens, MAX_CHARS, code_len_limit(opts));
+	huffman_canonical_codes(lens, MAX_CHARS, codes);
+
+	bf = bitfile_to_memory(table, sizeof(table));
+	write_lengths(bf, lens);
+	bitfile_close_memory(bf, &table_len);
+
+	if (!worth_coding(freqs, lens, len, 4*streams + table_len))
+		return store_block(out, data, len, stats);
+
+	if (opts->context && len >= CONTEXT_MIN_LEN) {
+		packed = compress_context(out, data, len, opts, 1 + 4*streams +
+					  table_len +
+					  coded_len(freqs, lens, len), stats);
+		if (packed)
+			return packed;
+	}
+
+	/* Size the substreams up front for the jump table */
+	memset(bits, 0, sizeof(bits));
+	for (i=0, k=0; i<len; i++) {
+		bits[k] += codes[data[i]].len;
+		if (++k == streams)
+			k = 0;
+	}
+
+	packed = 1 + 4*streams + table_len;
+	for (k=0; k<streams; k++)
+		packed += (bits[k] + 7) / 8;
+
+	/* A sampled estimate can be off */
+	if (packed >= 1 + len)
+		return store_block(out, data, len, stats);
+
+	bitfile_put_u32(out, len);
+	bitfile_put_u32(out, packed);
+	bitfile_put_byte(out, streams);
+	for (k=0; k<streams; k++)
+		bitfile_put_u32(out, (bits[k] + 7) / 8);
+	bitfile_put_bytes(out, table, table_len);
+
+	for (k=0; k<streams; k++) {
+		for (i=k; i<len; i+=streams)
+			bitfile_put_code(out, codes[data[i]].bits,
+					 codes[data[i]].len);
+		bitfile_align(out);
+	}
+
+	stats->in_bits += 8.0 * len;
+	stats->out_bits += 8.0 * (packed + 8);
+	return packed + 8;
+}
+
+/* A block coded by a worker of a block_pool */
+struct block_job {
+	u8 *in;            /* Input, 'in_len' bytes */
+	size_t in_len;
+	u8 *out;           /* Output, 'out_len' bytes */
+	size_t out_len;
+	struct hcpak_stats stats;
+	int done;          /* Non-zero once 'out' is ready */
+};
+
+/* Worker threads coding blocks. Jobs are handed out in the order they
+   are submitted and collected in the same order, so the output does
+   not depend on which worker finishes first. */
+struct block_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t *threads;
+	int nthreads;
+
+	struct block_job *jobs; /* Ring of 'count' jobs */
+	int count;
+	unsigned long queued;   /* Jobs submitted so far */
+	unsigned long taken;    /* Jobs taken by a worker so far */
+	int quit;               /* Tells the workers to exit */
+
+	size_t out_cap;         /* Size of the output buffers */
+	const struct hcpak_options *opts;
+	void (*code)(struct block_pool *pool, struct block_job *job);
+};
+
+static void * pool_thread(void *arg)
+{
+	struct block_pool *pool = arg;
+	struct block_job *job;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (pool->taken == pool->queued && !pool->quit)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		if (pool->taken == pool->queued)
+			break;
+		job = &pool->jobs[pool->taken++ % pool->count];
+		pthread_mutex_unlock(&pool->lock);
+
+		pool->code(pool, job);
+
+		pthread_mutex_lock(&pool->lock);
+		job->done = 1;
+		pthread_cond_broadcast(&pool->cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+/* Start 'nthreads' workers running 'code' on jobs with input buffers of
+   'in_cap' and output buffers of 'out_cap' bytes */
+static void pool_start(struct block_pool *pool, int nthreads,
+		       size_t in_cap, size_t out_cap,
+		       void (*code)(struct block_pool *, struct block_job *))
+{
+	int i;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pool->nthreads = nthreads;
+	pool->count = 2 * nthreads;
+	pool->queued = pool->taken = 0;
+	pool->quit = 0;
+	pool->out_cap = out_cap;
+	pool->code = code;
+
+	pool->jobs = xmalloc(pool->count * sizeof(struct block_job));
+	for (i=0; i<pool->count; i++) {
+		pool->jobs[i].in = xmalloc(in_cap);
+		pool->jobs[i].out = xmalloc(out_cap);
+	}
+
+	pool->threads = xmalloc(nthreads * sizeof(pthread_t));
+	for (i=0; i<nthreads; i++)
+		if (pthread_create(&pool->threads[i], NULL, pool_thread, pool))
+			error("Unable to create a worker thread!");
+}
+
+/* Job to fill in before pool_submit(), or NULL if all are in use */
+static struct block_job * pool_next(struct block_pool *pool,
+				    unsigned long collected)
+{
+	if (pool->queued - collected == pool->count)
+		return NULL;
+	return &pool->jobs[pool->queued % pool->count];
+}
+
+/* Hand the job from pool_next() to the workers */
+static void pool_submit(struct block_pool *pool)
+{
+	struct block_job *job = &pool->jobs[pool->queued % pool->count];
+
+	job->done = 0;
+	memset(&job->stats, 0, sizeof(job->stats));
+
+	pthread_mutex_lock(&pool->lock);
+	pool->queued++;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Wait for job number 'seq' to be done */
+static struct block_job * pool_wait(struct block_pool *pool,
+				    unsigned long seq)
+{
+	struct block_job *job = &pool->jobs[seq % pool->count];
+
+	pthread_mutex_lock(&pool->lock);
+	while (!job->done)
+		pthread_cond_wait(&pool->cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	return job;
+}
+
+/* Stop the workers once the submitted jobs are done */
+static void pool_stop(struct block_pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i=0; i<pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->cond);
+
+	for (i=0; i<pool->count; i++) {
+		xfree(pool->jobs[i].in);
+		xfree(pool->jobs[i].out);
+	}
+	xfree(pool->jobs);
+	xfree(pool->threads);
+}
+
+/* Worker side of compress_blocks() */
+static void compress_job(struct block_pool *pool, struct block_job *job)
+{
+	struct bitfile *bf = bitfile_to_memory(job->out, pool->out_cap);
+	u8 *out;
+
+	compress_block(bf, job->in, job->in_len, pool->opts, &job->stats);
+	out = bitfile_close_memory(bf, &job->out_len);
+	assert(out == job->out);
+}
+
+/* Worker side of count_frequencies_parallel(): the output of a job is
+   the histogram of its input */
+static void count_job(struct block_pool *pool, struct block_job *job)
+{
+	u64 *counts = (u64 *)job->out;
+
+	memset(counts, 0, 256 * sizeof(u64));
+	huffman_count(job->in, job->in_len, counts);
+}
+
+/* calculate_frequencies() with the counting spread over 'threads'
+   threads, each counting chunks of the input into a table of its own.
+   The tables are summed as the chunks are done. */
+static void count_frequencies_parallel(struct bitfile *bf, u64 *freqs,
+				       int threads)
+{
+	struct block_pool pool;
+	struct block_job *job;
+	unsigned long done = 0;
+	size_t len;
+	int eof = 0, c;
+
+	memset(freqs, 0, MAX_CHARS * sizeof(u64));
+
+	pool.opts = NULL;
+	pool_start(&pool, threads, PARALLEL_COUNT_LEN, 256 * sizeof(u64),
+		   count_job);
+
+	while (1) {
+		while (!eof && (job = pool_next(&pool, done))) {
+			len = bitfile_read(bf, job->in, PARALLEL_COUNT_LEN);
+			eof = len < PARALLEL_COUNT_LEN;
+			if (len == 0)
+				break;
+			job->in_len = len;
+			pool_submit(&pool);
+		}
+		if (done == pool.queued)
+			break;
+
+		job = pool_wait(&pool, done++);
+		for (c=0; c<256; c++)
+			freqs[c] += ((u64 *)job->out)[c];
+	}
+
+	pool_stop(&pool);
+}
+
+/* File offsets of the version 3 blocks, for the seek index */
+struct block_index {
+	u64 *offsets;
+	size_t count;
+	size_t size;       /* Room in 'offsets' */
+};
+
+static void index_add(struct block_index *index, u64 offset)
+{
+	if (index->count == index->size) {
+		index->size = index->size ? 2 * index->size : 64;
+		index->offsets = xrealloc(index->offsets,
+					  index->size * sizeof(u64));
+	}
+	index->offsets[index->count++] = offset;
+}
+
+static void write_index(struct bitfile *out, const struct block_index *index)
+{
+	size_t i;
+
+	for (i=0; i<index->count; i++) {
+		bitfile_put_u32(out, (u32)(index->offsets[i] >> 32));
+		bitfile_put_u32(out, (u32)index->offsets[i]);
+	}
+	bitfile_put_u32(out, index->count);
+}
+
+/* Code 'in' a block at a time into version 3 */
+static void compress_blocks(struct bitfile *in, struct bitfile *out,
+			    const struct hcpak_options *opts,
+			    struct hcpak_stats *stats)
+{
+	struct block_index index;
+	u64 pos = MAGIC_LEN + 1 + 4;
+	size_t len;
+
+	index.offsets = NULL;
+	index.count = index.size = 0;
+
+	bitfile_put_bytes(out, (u8*)magic, MAGIC_LEN-1);
+	bitfile_put_byte(out, VERSION_3);
+	bitfile_put_byte(out, opts->index ? FLAG_INDEX : 0);
+	bitfile_put_u32(out, opts->block_len);
+
+	if (opts->threads > 1) {
+		struct block_pool pool;
+		struct block_job *job;
+		unsigned long written = 0;
+		int eof = 0;
+
+		pool.opts = opts;
+		pool_start(&pool, opts->threads, opts->block_len,
+			   8 + BLOCK_MAX_PACKED(opts->block_len), compress_job);
+
+		while (1) {
+			/* Keep the workers busy, then write the oldest block */
+			while (!eof && (job = pool_next(&pool, written))) {
+				len = bitfile_read(in, job->in, opts->block_len);
+				eof = len < opts->block_len;
+				if (len == 0)
+					break;
+				job->in_len = len;
+				pool_submit(&pool);
+			}
+			if (written == pool.queued)
+				break;
+
+			job = pool_wait(&pool, written++);
+			index_add(&index, pos);
+			pos += job->out_len;
+			bitfile_put_bytes(out, job->out, job->out_len);
+			stats->in_bits += job->stats.in_bits;
+			stats->out_bits += job->stats.out_bits;
+		}
+
+		pool_stop(&pool);
+	} else {
+		u8 *block = xmalloc(opts->block_len);
+
+		do {
+			len = bitfile_read(in, block, opts->block_len);
+			if (len > 0) {
+				index_add(&index, pos);
+				pos += compress_block(out, block, len, opts,
+						      stats);
+			}
+		} while (len == opts->block_len);
+
+		xfree(block);
+	}
+
+	/* An empty block ends the data */
+	bitfile_put_u32(out, 0);
+
+	if (opts->index)
+		write_index(out, &index);
+	xfree(index.offsets);
+}
+
+int hcpak_compress(struct bitfile *in, struct bitfile *out,
+		   const struct hcpak_options *opts,
+		   struct hcpak_stats *stats)
+{
+	struct hcpak_options defaults;
+	u64 freqs[MAX_CHARS];
+	struct hccode codes[MAX_CHARS];
+	u8 lens[MAX_CHARS];
+	u8 table[TABLE_MAX_LEN];
+	struct bitfile *bf;
+	size_t table_len;
+	u64 total = 0, size, extra;
+	int i, streams, sampled;
+
+	if (opts == NULL) {
+		hcpak_default_options(&defaults);
+		opts = &defaults;
+	}
+	if (opts->max_code_len < HCPAK_MIN_CODE_LEN ||
+	    opts->max_code_len > HCPAK_MAX_CODE_LEN)
+		error("Maximum code length must be %d-%d bits.",
+		      HCPAK_MIN_CODE_LEN, HCPAK_MAX_CODE_LEN);
+	if (opts->streams < 1 || opts->streams > HCPAK_MAX_STREAMS)
+		error("Number of streams must be 1-%d.", HCPAK_MAX_STREAMS);
+	if (opts->block_len != 0 &&
+	    (opts->block_len < HCPAK_MIN_BLOCK_LEN ||
+	     opts->block_len > HCPAK_MAX_BLOCK_LEN))
+		error("Block length must be %d-%d bytes.",
+		      HCPAK_MIN_BLOCK_LEN, HCPAK_MAX_BLOCK_LEN);
+	if (opts->threads < 1 || opts->threads > HCPAK_MAX_THREADS)
+		error("Number of threads must be 1-%d.", HCPAK_MAX_THREADS);
+	if (opts->index && (opts->block_len == 0 || opts->adaptive))
+		error("A seek index needs the input coded in blocks.");
+
+	stats->in_bits = stats->out_bits = 0;
+
+	/* A dictionary has the code, only its ID is written */
+	if (opts->dict) {
+		bitfile_put_bytes(out, (u8*)magic, MAGIC_LEN-1);
+		bitfile_put_byte(out, VERSION_2);
+		bitfile_put_byte(out, FLAG_DICT);
+		bitfile_put_u32(out, opts->dict->id);
+		compress_stream(in, out, opts->dict->codes, stats);
+		return 0;
+	}
+
+	/* The adaptive code needs no frequencies, so no second pass */
+	if (opts->adaptive) {
+		bitfile_put_bytes(out, (u8*)magic, MAGIC_LEN-1);
+		bitfile_put_byte(out, VERSION_2);
+		bitfile_put_byte(out, FLAG_ADAPTIVE);
+		compress_adaptive(in, out, stats);
+		return 0;
+	}
+
+	/* Blocks are coded as they are read, one pass too */
+	if (opts->block_len) {
+		compress_blocks(in, out, opts, stats);
+		return 0;
+	}
+
+	sampled = opts->sample && bitfile_size(in, &size) == 0 &&
+		size > SAMPLE_WINDOWS * SAMPLE_LEN;
+	if (sampled)
+		sample_frequencies(in, size, freqs);
+	else if (opts->threads > 1)
+		count_frequencies_parallel(in, freqs, opts->threads);
+	else
+		calculate_frequencies(in, freqs);
+
+	for (i=0; i<EOFCHAR; i++)
+		total += freqs[i];
+	if (total == 0)
+		error("Compressing empty files is not supported.");
+	if (!sampled)
+		size = total;
+
+	/* Small inputs are not worth the jump table */
+	streams = total < STREAMS_MIN_LEN ? 1 : opts->streams;
+
+	/* Substreams know their length and need no EOFCHAR */
+	freqs[EOFCHAR] = streams > 1 ? 0 : 1;
+
+	/* Only the code lengths are stored, the codes are canonical */
+	huffman_lengths(freqs, MAX_CHARS, lens);
+	huffman_limit_lengths(lens, MAX_CHARS, code_len_limit(opts));
+	huffman_canonical_codes(lens, MAX_CHARS, codes);
+
+	bf = bitfile_to_memory(table, sizeof(table));
+	write_lengths(bf, lens);
+	bitfile_close_memory(bf, &table_len);
+
+	/* Substreams add their count and a jump table per region, then
+	   the empty region ending the data */
+	extra = table_len;
+	if (streams > 1)
+		extra += 1 + (size / REGION_LEN + 1) * (4 + 4*streams) + 4;
+
+	if (!worth_coding(freqs, lens, size, extra)) {
+		bitfile_put_bytes(out, (u8*)magic, MAGIC_LEN-1);
+		bitfile_put_byte(out, VERSION_2);
+		bitfile_put_byte(out, FLAG_STORED);
+		bitfile_rewind(in);
+		copy_stored(in, out, stats);
+		stats->out_bits += 8.0 * (MAGIC_LEN + 1);
+		return 0;
+	}
+
+	/* Write header */
+	bitfile_put_bytes(out, (u8*)magic, MAGIC_LEN-1);
+	bitfile_put_byte(out, VERSION_2);
+	if (streams > 1) {
+		bitfile_put_byte(out, FLAG_STREAMS);
+		bitfile_put_byte(out, streams);
+	} else {
+		bitfile_put_byte(out, 0);
+	}
+	write_lengths(out, lens);
+
+	/* Write data */
+	bitfile_rewind(in);
+
+	if (streams > 1)
+		compress_streams(in, out, codes, streams, stats);
+	else
+		compress_stream(in, out, codes, stats);
+
+	return 0;
+}
+
+/* Decode one stream ended by EOFCHAR. With 'multi' set, short codes
+   are decoded several at a time with the multi-symbol table of 'dec'.
+   'dec' is only read. */
+static void decompress_stream(struct bitfile *in, struct bitfile *out,
+			      struct hcdecoder *dec, int multi,
+			      const struct hccode codes[],
+			      struct hcpak_stats *stats)
+{
+	u64 code_bits = 0, count = 0;
+
+	/* Decompress input a table lookup at a time until EOFCHAR */
+	while(1) {
+		int c;
+
+		if (multi) {
+			u8 syms[HC_MULTI_SYMS];
+			int i, n = huffman_decode_multi(dec, in, syms);
+
+			if (n > 0) {
+				for (i=0; i<n; i++) {
+					bitfile_put_byte(out, syms[i]);
+					code_bits += codes[syms[i]].len;
+				}
+				count += n;
+				continue;
+			}
+		}
+
+		c = huffman_decode(dec, in);
+
+		if (c == HC_DECODE_END || c == EOFCHAR)
+			break;
+		if (c == HC_DECODE_INVALID)
+			error("Code not found! File corrupted?");
+
+		bitfile_put_byte(out, (u8) c);
+		code_bits += codes[c].len;
+		count++;
+	}
+
+	stats->in_bits = code_bits;
+	stats->out_bits = 8.0 * count;
+}
+
+/* Decode an adaptive code until EOFCHAR */
+static void decompress_adaptive(struct bitfile *in, struct bitfile *out,
+				struct hcpak_stats *stats)
+{
+	struct hcadaptive *a = adaptive_new();
+	u64 code_bits = 0, count = 0;
+
+	while(1) {
+		int c = adaptive_decode(a, in, &code_bits);
+
+		if (c == HC_DECODE_END || c == EOFCHAR)
+			break;
+		if (c == HC_DECODE_INVALID)
+			error("Invalid symbol! File corrupted?");
+
+		bitfile_put_byte(out, (u8) c);
+		count++;
+	}
+
+	stats->in_bits = code_bits;
+	stats->out_bits = 8.0 * count;
+	adaptive_free(a);
+}
+
+/* Decode regions of 'count' interleaved substreams */
+static void decompress_streams(struct bitfile *in, struct bitfile *out,
+			       struct hcdecoder *dec, int count,
+			       struct hcpak_stats *stats)
+{
+	size_t cap = (REGION_LEN / count + 1) * 4 + 8;
+	u8 *region = xmalloc(REGION_LEN);
+	u8 *data = xmalloc(cap * count);
+	size_t lens[HC_MAX_STREAMS];
+	int k;
+
+	bitfile_align(in);
+
+	while (1) {
+		size_t total = 0;
+		u32 n, len;
+
+		if (bitfile_get_u32(in, &n) != 0)
+			error("Input too short!");
+		if (n == 0)
+			break;
+		if (n > REGION_LEN)
+			error("Invalid region length %u!", n);
+
+		for (k=0; k<count; k++) {
+			if (bitfile_get_u32(in, &len) != 0)
+				error("Input too short!");
+			if (len > cap)
+				error("Invalid substream length %u!", len);
+			lens[k] = len;
+			total += len;
+		}
+		if (bitfile_get_bytes(in, data, total) != 0)
+			error("Input too short!");
+
+		if (huffman_decode_streams(dec, data, lens, count, region, n))
+			error("Code not found! File corrupted?");
+
+		bitfile_put_bytes(out, region, n);
+		stats->in_bits += 8.0 * total;
+		stats->out_bits += 8.0 * n;
+	}
+
+	xfree(data);
+	xfree(region);
+}
+
+/* Decode a context block of 'packed_len' bytes into 'len' bytes */
+static void decompress_context(const u8 *packed, size_t packed_len,
+			       u8 *data, size_t len)
+{
+	struct hcdecoder *decs[CONTEXT_TABLES];
+	struct hccode codes[MAX_CHARS];
+	u8 lens[MAX_CHARS], map[256];
+	struct bitfile *bf;
+	size_t stream_len;
+	int count, j, k;
+
+	if (packed_len < CONTEXT_HEAD_LEN)
+		error("Invalid block header!");
+	stream_len = load_be32(packed + 1);
+	count = packed[5];
+	if (stream_len > packed_len - CONTEXT_HEAD_LEN ||
+	    count < 1 || count > CONTEXT_TABLES)
+		error("Invalid block header!");
+
+	for (j=0; j<256; j+=2) {
+		map[j] = packed[6 + j/2] >> 4;
+		map[j+1] = packed[6 + j/2] & 0xf;
+		if (map[j] >= count || map[j+1] >= count)
+			error("Invalid block header!");
+	}
+
+	/* The code length tables fill the space up to the coded data */
+	bf = bitfile_from_memory(packed + CONTEXT_HEAD_LEN,
+				 packed_len - CONTEXT_HEAD_LEN - stream_len);
+	for (k=0; k<count; k++) {
+		read_lengths(bf, lens);
+		memset(codes, 0, sizeof(codes));
+		if (huffman_canonical_codes(lens, MAX_CHARS, codes) != 0)
+			error("Invalid code length table!");
+		decs[k] = huffman_decoder(codes, MAX_CHARS);
+	}
+	bitfile_close(bf);
+
+	if (huffman_decode_context(decs, map, packed + packed_len - stream_len,
+				   stream_len, data, len))
+		error("Code not found! File corrupted?");
+
+	for (k=0; k<count; k++)
+		huffman_decoder_free(decs[k]);
+}
+
+/* Decode a version 3 block of 'packed_len' bytes into 'len' bytes */
+static void decompress_block(const u8 *packed, size_t packed_len,
+			     u8 *data, size_t len)
+{
+	struct hccode codes[MAX_CHARS];
+	struct hcdecoder *dec;
+	struct bitfile *bf;
+	size_t lens[HC_MAX_STREAMS];
+	size_t head, total = 0;
+	u8 code_lens[MAX_CHARS];
+	int k, streams;
+
+	if (packed_len < 1)
+		error("Invalid block header!");
+	streams = packed[0];
+
+	if (streams == 0) {
+		if (packed_len != 1 + len)
+			error("Invalid block header!");
+		memcpy(data, packed + 1, len);
+		return;
+	}
+	if (streams == BLOCK_CONTEXT) {
+		decompress_context(packed, packed_len, data, len);
+		return;
+	}
+
+	head = 1 + 4*streams;
+	if (streams > HCPAK_MAX_STREAMS || packed_len < head)
+		error("Invalid block header!");
+
+	for (k=0; k<streams; k++) {
+		lens[k] = load_be32(packed + 1 + 4*k);
+		total += lens[k];
+	}
+	if (total > packed_len - head)
+		error("Invalid block header!");
+
+	/* The code length table fills the space up to the substreams */
+	bf = bitfile_from_memory(packed + head, packed_len - head - total);
+	read_lengths(bf, code_lens);
+	bitfile_close(bf);
+
+	memset(codes, 0, sizeof(codes));
+	if (huffman_canonical_codes(code_lens, MAX_CHARS, codes) != 0)
+		error("Invalid code length table!");
+
+	dec = huffman_decoder(codes, MAX_CHARS);
+	if (huffman_decode_streams(dec, packed + packed_len - total, lens,
+				   streams, data, len))
+		error("Code not found! File corrupted?");
+	huffman_decoder_free(dec);
+}
+
+/* Worker side of decompress_blocks() */
+static void decompress_job(struct block_pool *pool, struct block_job *job)
+{
+	decompress_block(job->in, job->in_len, job->out, job->out_len);
+}
+
+/* Read the header of the next version 3 block. Returns zero at the
+   end of the data. */
+static int read_block_header(struct bitfile *in, u32 block_len,
+			     u32 *len, u32 *packed_len)
+{
+	if (bitfile_get_u32(in, len) != 0)
+		error("Input too short!");
+	if (*len == 0)
+		return 0;
+	if (bitfile_get_u32(in, packed_len) != 0)
+		error("Input too short!");
+	if (*len > block_len || *packed_len > BLOCK_MAX_PACKED(*len))
+		error("Invalid block length!");
+	return 1;
+}
+
+/* Read the version 3 header after the magic. Returns the flags. */
+static u8 read_blocks_header(struct bitfile *in, u32 *block_len)
+{
+	u8 flags;
+
+	if (bitfile_get_byte(in, &flags) != 0 ||
+	    bitfile_get_u32(in, block_len) != 0)
+		error("Input too short!");
+	if (flags & ~FLAG_INDEX)
+		error("Unsupported flags 0x%x on input!", flags);
+	if (*block_len < HCPAK_MIN_BLOCK_LEN ||
+	    *block_len > HCPAK_MAX_BLOCK_LEN)
+		error("Invalid block length %u!", *block_len);
+	return flags;
+}
+
+/* Decode the blocks of version 3 */
+static void decompress_blocks(struct bitfile *in, struct bitfile *out,
+			      const struct hcpak_options *opts,
+			      struct hcpak_stats *stats)
+{
+	u32 block_len, len, packed_len;
+
+	read_blocks_header(in, &block_len);
+
+	if (opts->threads > 1) {
+		struct block_pool pool;
+		struct block_job *job;
+		unsigned long written = 0;
+		int eof = 0;
+
+		/* The block headers give the size of each block, so whole
+		   blocks are read ahead and decoded out of order */
+		pool.opts = opts;
+		pool_start(&pool, opts->threads, BLOCK_MAX_PACKED(block_len),
+			   block_len, decompress_job);
+
+		while (1) {
+			while (!eof && (job = pool_next(&pool, written))) {
+				if (!read_block_header(in, block_len, &len,
+						       &packed_len)) {
+					eof = 1;
+					break;
+				}
+				if (bitfile_get_bytes(in, job->in, packed_len))
+					error("Input too short!");
+				job->in_len = packed_len;
+				job->out_len = len;
+				pool_submit(&pool);
+			}
+			if (written == pool.queued)
+				break;
+
+			job = pool_wait(&pool, written++);
+			bitfile_put_bytes(out, job->out, job->out_len);
+			stats->in_bits += 8.0 * (job->in_len + 8);
+			stats->out_bits += 8.0 * job->out_len;
+		}
+
+		pool_stop(&pool);
+	} else {
+		u8 *packed = xmalloc(BLOCK_MAX_PACKED(block_len));
+		u8 *data = xmalloc(block_len);
+
+		while (read_block_header(in, block_len, &len, &packed_len)) {
+			if (bitfile_get_bytes(in, packed, packed_len) != 0)
+				error("Input too short!");
+			decompress_block(packed, packed_len, data, len);
+			bitfile_put_bytes(out, data, len);
+
+			stats->in_bits += 8.0 * (packed_len + 8);
+			stats->out_bits += 8.0 * len;
+		}
+
+		xfree(data);
+		xfree(packed);
+	}
+}
+
+/* Decode data coded with the dictionary 'dict' (NULL if none given) */
+static void decompress_dict(struct bitfile *in, struct bitfile *out,
+			    const struct hcpak_dict *dict,
+			    struct hcpak_stats *stats)
+{
+	u32 id;
+
+	if (bitfile_get_u32(in, &id) != 0)
+		error("Input too short!");
+	if (dict == NULL)
+		error("Input needs dictionary %08x!", id);
+	if (dict->id != id)
+		error("Input needs dictionary %08x, not %08x!", id, dict->id);
+
+	decompress_stream(in, out, dict->dec, dict->multi, dict->codes, stats);
+}
+
+int hcpak_decompress(struct bitfile *in, struct bitfile *out,
+		     const struct hcpak_options *opts,
+		     struct hcpak_stats *stats)
+{
+	struct hcpak_options defaults;
+	struct hccode codes[MAX_CHARS];
+	struct hcdecoder *dec;
+	u8 magicbuf[MAGIC_LEN];
+	u8 lens[MAX_CHARS];
+	u8 flags = 0, streams = 1;
+	int multi;
+
+	if (opts == NULL) {
+		hcpak_default_options(&defaults);
+		opts = &defaults;
+	}
+	if (opts->threads < 1 || opts->threads > HCPAK_MAX_THREADS)
+		error("Number of threads must be 1-%d.", HCPAK_MAX_THREADS);
+
+	stats->in_bits = stats->out_bits = 0;
+
+	/* Check magic */
+	if (bitfile_get_bytes(in, magicbuf, MAGIC_LEN) != 0)
+		error("Input too short!");
+
+	if (memcmp(magicbuf, magic, MAGIC_LEN-1) != 0)
+		error("Magic mismatch on input!");
+
+	memset(codes, 0, sizeof(codes));
+
+	switch (magicbuf[MAGIC_LEN-1]) {
+	case VERSION_3:
+		decompress_blocks(in, out, opts, stats);
+		return 0;
+	case VERSION_1:
+		read_freq_table(in, codes);
+		break;
+	case VERSION_2:
+		if (bitfile_get_byte(in, &flags) != 0)
+			error("Input too short!");
+		if (flags != FLAG_STREAMS && flags != FLAG_ADAPTIVE &&
+		    flags != FLAG_STORED && flags != FLAG_DICT && flags != 0)
+			error("Unsupported flags 0x%x on input!", flags);
+		if (flags & FLAG_DICT) {
+			decompress_dict(in, out, opts->dict, stats);
+			return 0;
+		}
+		if (flags & FLAG_ADAPTIVE) {
+			decompress_adaptive(in, out, stats);
+			return 0;
+		}
+		if (flags & FLAG_STORED) {
+			copy_stored(in, out, stats);
+			return 0;
+		}
+		if ((flags & FLAG_STREAMS) &&
+		    (bitfile_get_byte(in, &streams) != 0 ||
+		     streams < 2 || streams > HCPAK_MAX_STREAMS))
+			error("Invalid number of streams on input!");
+
+		read_lengths(in, lens);
+		if ((streams == 1 && lens[EOFCHAR] == 0) ||
+		    huffman_canonical_codes(lens, MAX_CHARS, codes) != 0)
+			error("Invalid code length table!");
+		break;
+	default:
+		error("Unsupported format version '%c' on input!",
+		      magicbuf[MAGIC_LEN-1]);
+	}
+
+	dec = huffman_decoder(codes, MAX_CHARS);
+
+	if (streams > 1) {
+		decompress_streams(in, out, dec, streams, stats);
+	} else {
+		/* Short codes are decoded several at a time when on
+		   average more than one fits in a lookup */
+		multi = huffman_decoder_multi(dec, MULTI_MIN_SYMS) >=
+			MULTI_MIN_SYMS;
+		decompress_stream(in, out, dec, multi, codes, stats);
+	}
+
+	huffman_decoder_free(dec);
+
+	return 0;
+}
+
+/* Find block 'first' through the seek index of 'in', 'size' bytes, and
+   move there. Returns non-zero if there is no such block. */
+static int seek_index(struct bitfile *in, u64 size, u64 first)
+{
+	u64 offset;
+	u32 count, hi, lo;
+
+	if (size < MAGIC_LEN + 5 + 4 + 4)
+		error("Input too short!");
+
+	bitfile_seek(in, size - 4);
+	if (bitfile_get_u32(in, &count) != 0 ||
+	    8.0 * count > size - (MAGIC_LEN + 5 + 4 + 4))
+		error("Invalid seek index!");
+	if (first >= count)
+		return 1;
+
+	bitfile_seek(in, size - 4 - 8 * (u64)count + 8 * first);
+	if (bitfile_get_u32(in, &hi) != 0 || bitfile_get_u32(in, &lo) != 0)
+		error("Input too short!");
+	offset = (u64)hi << 32 | lo;
+	if (offset < MAGIC_LEN + 5 || offset >= size)
+		error("Invalid seek index!");
+
+	bitfile_seek(in, offset);
+	return 0;
+}
+
+int hcpak_decompress_range(struct bitfile *in, struct bitfile *out,
+			   u64 start, u64 len, struct hcpak_stats *stats)
+{
+	u8 magicbuf[MAGIC_LEN];
+	u8 *packed, *data;
+	u32 block_len, n, packed_len;
+	u64 block, skip, size;
+	u64 pos = MAGIC_LEN + 1 + 4;
+	u8 flags;
+
+	stats->in_bits = stats->out_bits = 0;
+
+	if (bitfile_get_bytes(in, magicbuf, MAGIC_LEN) != 0)
+		error("Input too short!");
+	if (memcmp(magicbuf, magic, MAGIC_LEN-1) != 0)
+		error("Magic mismatch on input!");
+	if (magicbuf[MAGIC_LEN-1] != VERSION_3)
+		error("Ranges need input coded in blocks (version 3)!");
+
+	flags = read_blocks_header(in, &block_len);
+	block = start / block_len;
+	skip = start % block_len;
+
+	packed = xmalloc(BLOCK_MAX_PACKED(block_len));
+	data = xmalloc(block_len);
+
+	if ((flags & FLAG_INDEX) && bitfile_size(in, &size) == 0) {
+		if (seek_index(in, size, block) != 0)
+			len = 0;
+	} else if (bitfile_size(in, &size) == 0) {
+		/* Walk the block headers up to the first block needed,
+		   seeking over the data in between */
+		for (; block > 0 && len > 0; block--) {
+			if (!read_block_header(in, block_len, &n, &packed_len)) {
+				len = 0;
+			} else {
+				pos += 8 + (u64)packed_len;
+				bitfile_seek(in, pos);
+			}
+		}
+	} else {
+		/* Pipes cannot seek, so the data in between is read */
+		for (; block > 0 && len > 0; block--) {
+			if (!read_block_header(in, block_len, &n, &packed_len))
+				len = 0;
+			else if (bitfile_get_bytes(in, packed, packed_len))
+				error("Input too short!");
+		}
+	}
+
+	while (len > 0 && read_block_header(in, block_len, &n, &packed_len)) {
+		if (bitfile_get_bytes(in, packed, packed_len) != 0)
+			error("Input too short!");
+		decompress_block(packed, packed_len, data, n);
+
+		if (skip >= n)
+			break;
+		n -= skip;
+		if (n > len)
+			n = len;
+		bitfile_put_bytes(out, data + skip, n);
+		skip = 0;
+		len -= n;
+
+		stats->in_bits += 8.0 * (packed_len + 8);
+		stats->out_bits += 8.0 * n;
+	}
+
+	xfree(data);
+	xfree(packed);
+
+	return 0;
+}
+
+/* Set up 'lens' into a dictionary */
+static struct hcpak_dict * dict_new(const u8 lens[])
+{
+	struct hcpak_dict *dict = xmalloc(sizeof(struct hcpak_dict));
+	u32 id = 2166136261U;
+	int c;
+
+	/* FNV-1a of the lengths: the same code gets the same ID */
+	for (c=0; c<MAX_CHARS; c++)
+		id = (id ^ lens[c]) * 16777619U;
+	dict->id = id;
+
+	for (c=0; c<MAX_CHARS; c++)
+		if (lens[c] > HCPAK_MAX_CODE_LEN)
+			error("Invalid code length table!");
+
+	memcpy(dict->lens, lens, MAX_CHARS);
+	memset(dict->codes, 0, sizeof(dict->codes));
+	if (huffman_canonical_codes(lens, MAX_CHARS, dict->codes) != 0)
+		error("Invalid code length table!");
+	dict->dec = huffman_decoder(dict->codes, MAX_CHARS);
+	dict->multi = huffman_decoder_multi(dict->dec, MULTI_MIN_SYMS) >=
+		MULTI_MIN_SYMS;
+
+	return dict;
+}
+
+struct hcpak_dict * hcpak_dict_train(struct bitfile *in,
+				     const struct hcpak_options *opts)
+{
+	struct hcpak_options defaults;
+	u64 freqs[MAX_CHARS];
+	u8 lens[MAX_CHARS];
+	int max_len;
+
+	if (opts == NULL) {
+		hcpak_default_options(&defaults);
+		opts = &defaults;
+	}
+	max_len = opts->max_code_len;
+	if (max_len < SAMPLE_MIN_CODE_LEN)
+		max_len = SAMPLE_MIN_CODE_LEN;
+
+	/* Inputs coded later may hold any byte */
+	calculate_frequencies(in, freqs);
+	count_unsampled(freqs);
+	freqs[EOFCHAR] = 1;
+
+	huffman_lengths(freqs, MAX_CHARS, lens);
+	huffman_limit_lengths(lens, MAX_CHARS, max_len);
+
+	return dict_new(lens);
+}
+
+void hcpak_dict_save(const struct hcpak_dict *dict, struct bitfile *out)
+{
+	bitfile_put_bytes(out, (u8*)dict_magic, MAGIC_LEN);
+	bitfile_put_u32(out, dict->id);
+	write_lengths(out, dict->lens);
+}
+
+struct hcpak_dict * hcpak_dict_load(struct bitfile *in)
+{
+	struct hcpak_dict *dict;
+	u8 magicbuf[MAGIC_LEN];
+	u8 lens[MAX_CHARS];
+	u32 id;
+	int c;
+
+	if (bitfile_get_bytes(in, magicbuf, MAGIC_LEN) != 0 ||
+	    bitfile_get_u32(in, &id) != 0)
+		error("Dictionary too short!");
+	if (memcmp(magicbuf, dict_magic, MAGIC_LEN) != 0)
+		error("Magic mismatch on dictionary!");
+
+	/* Inputs may hold any byte, so every symbol needs a code */
+	read_lengths(in, lens);
+	for (c = 0; c < MAX_CHARS; c++)
+		if (lens[c] == 0)
+			error("Invalid code length table!");
+
+	dict = dict_new(lens);
+	if (dict->id != id)
+		error("Dictionary corrupted!");
+	return dict;
+}
+
+u32 hcpak_dict_id(const struct hcpak_dict *dict)
+{
+	return dict->id;
+}
+
+void hcpak_dict_free(struct hcpak_dict *dict)
+{
+	if (dict)
+		huffman_decoder_free(dict->dec);
+	xfree(dict);
+}
+
+size_t hcpak_msg_compress(const struct hcpak_dict *dict, const u8 *src,
+			  size_t len, u8 *dst, size_t cap)
+{
+	const struct hccode *codes = dict->codes;
+	u8 *pos = dst, *end = dst + cap;
+	u64 acc = 0;
+	int count = 0;
+	size_t i;
+
+	/* Codes are at most 32 bits and less than 32 bits are left over
+	   after each, so the accumulator cannot overflow */
+	for (i=0; i<len; i++) {
+		acc = acc << codes[src[i]].len | codes[src[i]].bits;
+		count += codes[src[i]].len;
+		if (count >= 32) {
+			if (end - pos < 4)
+				return 0;
+			count -= 32;
+			pos[0] = (u8)(acc >> (count + 24));
+			pos[1] = (u8)(acc >> (count + 16));
+			pos[2] = (u8)(acc >> (count + 8));
+			pos[3] = (u8)(acc >> count);
+			pos += 4;
+		}
+	}
+
+	/* Then the whole and partial bytes left */
+	for (; count > 0; count -= 8) {
+		if (pos == end)
+			return 0;
+		*pos++ = (u8)(count >= 8 ? acc >> (count - 8) : acc << (8 - count));
+	}
+
+	return pos - dst;
+}
+
+int hcpak_msg_decompress(const struct hcpak_dict *dict, const u8 *src,
+			 size_t src_len, u8 *dst, size_t len)
+{
+	/* dict->dec has a multi-symbol table only when dict->multi says
+	   it pays off, so long codes skip straight to single lookups */
+	return huffman_decode_streams(dict->dec, src, &src_len, 1, dst, len);
+}
@@ -0,0 +1,120 @@
+/*
+ * hcpak.h - huffman's code compression of bitfiles
+ *
+ * Copyright (C) 2008 Jussi Mäki <joamaki@gmail.com>
+ */
+
+#ifndef __HCPAK_H
+#define __HCPAK_H
+
+struct bitfile;
+struct hcpak_dict;
+
+/* Limits of the longest code length. By default every code fits the root
+   table of the decoder (HC_DECODE_BITS). */
+#define HCPAK_MIN_CODE_LEN 9
+#define HCPAK_MAX_CODE_LEN 32
+#define HCPAK_DEFAULT_CODE_LEN 11
+
+/* Interleaved substreams by default; 1 writes a single stream */
+#define HCPAK_MAX_STREAMS 8
+#define HCPAK_DEFAULT_STREAMS 4
+
+/* Input bytes per independently coded block by default; 0 writes
+   everything with a single code in the older version 2 format */
+#define HCPAK_MIN_BLOCK_LEN (64*1024)
+#define HCPAK_MAX_BLOCK_LEN (16*1024*1024)
+#define HCPAK_DEFAULT_BLOCK_LEN (1024*1024)
+
+/* Most worker threads */
+#define HCPAK_MAX_THREADS 256
+
+/* Compression options */
+struct hcpak_options {
+	int max_code_len;  /* Longest code length in bits */
+	int streams;       /* Substreams decoded side by side (1-8),
+			      small inputs always use one */
+	int adaptive;      /* Single pass adaptive code; 'streams' and
+			      'block_len' are ignored */
+	int block_len;     /* Bytes per block, 0 for a single code */
+	int threads;       /* Threads coding or decoding blocks, or
+			      counting frequencies for a single code,
+			      1 for the calling thread only */
+	int index;         /* Non-zero to end blocks with a seek index */
+	int sample;        /* Non-zero to build codes from frequencies
+			      sampled from parts of the input; codes
+			      are then allowed at least 16 bits */
+	int context;       /* Non-zero to code blocks with codes chosen by
+			      the previous byte where that is smaller */
+	const struct hcpak_dict *dict; /* Trained code to use instead of
+					  one of the input's own, NULL for
+					  none. Overrides the above. */
+};
+
+/* Sizes seen by a compression or decompression, for reporting */
+struct hcpak_stats {
+	double in_bits;    /* Bits read (of codes when decompressing) */
+	double out_bits;   /* Bits written (of codes when compressing) */
+};
+
+/* Fill 'opts' with the default options */
+void hcpak_default_options(struct hcpak_options *opts);
+
+/* Compress all of 'in' into 'out' with options 'opts' (NULL for the
+   defaults). Without blocks or the adaptive code the input is read
+   twice, so 'in' must be rewindable. Failure -> call error(). */
+int hcpak_compress(struct bitfile *in, struct bitfile *out,
+		   const struct hcpak_options *opts,
+		   struct hcpak_stats *stats);
+
+/* Decompress all of 'in' into 'out'. Of 'opts' (NULL for the defaults)
+   only the number of threads and the dictionary are used; input coded
+   with a dictionary needs the same one. Failure -> call error(). */
+int hcpak_decompress(struct bitfile *in, struct bitfile *out,
+		     const struct hcpak_options *opts,
+		     struct hcpak_stats *stats);
+
+/* Decompress 'len' bytes of the data in 'in' from offset 'start' on
+   into 'out', or up to the end of the data if it ends first. Needs
+   input coded in blocks. Only the blocks holding the range are decoded;
+   with a seek index and a seekable input only they are read too.
+   Failure -> call error(). */
+int hcpak_decompress_range(struct bitfile *in, struct bitfile *out,
+			   u64 start, u64 len, struct hcpak_stats *stats);
+
+/* Build a dictionary, a code trained on all of 'in', for coding many
+   small inputs like it. Every byte gets a code. Of 'opts' (NULL for the
+   defaults) only the code length limit is used, raised to 16 bits as
+   with sampling. */
+struct hcpak_dict * hcpak_dict_train(struct bitfile *in,
+				     const struct hcpak_options *opts);
+
+/* Save a dictionary into a table file, or load one saved (failure ->
+   call error()) */
+void hcpak_dict_save(const struct hcpak_dict *dict, struct bitfile *out);
+struct hcpak_dict * hcpak_dict_load(struct bitfile *in);
+
+/* The ID stored in output coded with 'dict' */
+u32 hcpak_dict_id(const struct hcpak_dict *dict);
+
+/* Frees a dictionary */
+void hcpak_dict_free(struct hcpak_dict *dict);
+
+/* Room always enough for hcpak_msg_compress() of 'len' bytes */
+#define HCPAK_MSG_BOUND(len) ((len) * HCPAK_MAX_CODE_LEN / 8 + 1)
+
+/* Compress a message of 'len' bytes at 'src' into 'dst' of 'cap' bytes
+   with the code of 'dict' alone: no magic, header or end marker, so the
+   length must be passed on some other way. Uses no memory beyond 'dst'
+   and 'dict', which is only read. Returns the compressed length, or 0
+   if the output did not fit or 'len' is 0. */
+size_t hcpak_msg_compress(const struct hcpak_dict *dict, const u8 *src,
+			  size_t len, u8 *dst, size_t cap);
+
+/* Decompress a message of 'src_len' bytes at 'src' compressed by
+   hcpak_msg_compress() into its 'len' bytes at 'dst'. Returns non-zero
+   if the input is corrupt. */
+int hcpak_msg_decompress(const struct hcpak_dict *dict, const u8 *src,
+			 size_t src_len, u8 *dst, size_t len);
+
+#endif /* __HCPAK_H */
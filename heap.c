@@ -17,11 +17,7 @@
 #define HLEFT(i) (i*2+1)
 #define HRIGHT(i) (i*2+2)
 
-struct heap {
-	struct hcnode **nodes;
-	size_t count;
-	size_t max_count;
-};
+#define FREQ(h, i) ((h)->nodes[(h)->items[i]].frequency)
 
 static void heapify(struct heap *heap, size_t idx)
 {
@@ -33,18 +29,18 @@ static void heapify(struct heap *heap, size_t idx)
 		size_t l = HLEFT(idx);
 		size_t r = HRIGHT(idx);
 
-		if (l < heap->count && heap->nodes[l]->frequency < heap->nodes[idx]->frequency)
+		if (l < heap->count && FREQ(heap, l) < FREQ(heap, idx))
 			smallest = l;
 		else
 			smallest = idx;
 
-		if (r < heap->count && heap->nodes[r]->frequency < heap->nodes[smallest]->frequency)
+		if (r < heap->count && FREQ(heap, r) < FREQ(heap, smallest))
 			smallest = r;
 
 		if (smallest != idx) {
-			struct hcnode *t = heap->nodes[idx];
-			heap->nodes[idx] = heap->nodes[smallest];
-			heap->nodes[smallest] = t;
+			u16 t = heap->items[idx];
+			heap->items[idx] = heap->items[smallest];
+			heap->items[smallest] = t;
 			idx = smallest;
 		} else {
 			break;
@@ -52,32 +48,33 @@ static void heapify(struct heap *heap, size_t idx)
 	}
 }
 
-struct heap * heap_build(struct hcnode *nodes[], size_t count)
+void heap_build(struct heap *h, const struct hcnode nodes[],
+		const u16 items[], size_t count)
 {
 	int i;
-	struct heap *h = xmalloc(sizeof(struct heap));
-	h->nodes = xmalloc(sizeof(struct hcnode *) * count);
+
+	if (count > HC_MAX_SYMBOLS)
+		error("Heap overflow!");
+
+	h->nodes = nodes;
 	h->count = count;
-	h->max_count = count;
-	memcpy(h->nodes, nodes, count*(sizeof(struct hcnode *)));
+	memcpy(h->items, items, count*sizeof(u16));
 
 	for (i=count/2; i>0; i--)
 		heapify(h, i);
-
-	return h;
 }
 
-struct hcnode * heap_extract_min(struct heap *heap)
+u16 heap_extract_min(struct heap *heap)
 {
-	struct hcnode *n;
+	u16 n;
 	assert (heap != NULL);
 	if (heap->count < 1) {
 		error("Heap underflow!");
 	}
 
-	n = heap->nodes[0];
+	n = heap->items[0];
 	heap->count--;
-	heap->nodes[0] = heap->nodes[heap->count];
+	heap->items[0] = heap->items[heap->count];
 
 	if (heap->count)
 		heapify(heap, 0);
@@ -85,22 +82,11 @@ struct hcnode * heap_extract_min(struct heap *heap)
 	return n;
 }
 
-void heap_insert(struct heap *heap, struct hcnode *node)
+void heap_insert(struct heap *heap, u16 item)
 {
-	if (heap->max_count == heap->count) {
-		/* Double the heap size */
-		heap->max_count = heap->max_count * 2;
-		heap->nodes = xrealloc(heap->nodes, heap->max_count);
-	}
+	if (heap->count == HC_MAX_SYMBOLS)
+		error("Heap overflow!");
 	heap->count++;
-	heap->nodes[heap->count-1] = node;
+	heap->items[heap->count-1] = item;
 	heapify(heap, heap->count-1);
 }
-
-void heap_free(struct heap *heap)
-{
-	/* Heap must be empty, othewise we're leaking memory */
-	assert (heap->count == 0);
-	xfree(heap->nodes);
-	xfree(heap);
-}
@@ -7,19 +7,22 @@
 #ifndef __HEAP_H
 #define __HEAP_H
 
-struct heap;
-struct hcnode;
+/* Heap of node indices ordered by the frequency of the nodes they
+   refer to. Lives wherever the caller puts it, nothing is allocated. */
+struct heap {
+	const struct hcnode *nodes;
+	u16 items[HC_MAX_SYMBOLS];
+	size_t count;
+};
 
-/* Build heap from an array of nodes */
-struct heap * heap_build(struct hcnode *nodes[], size_t count);
+/* Build heap 'h' from 'count' indices into 'nodes' */
+void heap_build(struct heap *h, const struct hcnode nodes[],
+		const u16 items[], size_t count);
 
-/* Extract smallest node from heap */
-struct hcnode * heap_extract_min(struct heap *h);
+/* Extract index of the smallest node from heap */
+u16 heap_extract_min(struct heap *h);
 
-/* Free an _empty_ heap */
-void heap_free(struct heap *h);
-
-/* Add a new node to the heap */
-void heap_insert(struct heap *h, struct hcnode *node);
+/* Add a new node index to the heap */
+void heap_insert(struct heap *h, u16 item);
 
 #endif /* __HEAP_H */
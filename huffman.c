@@ -4,130 +4,617 @@
  * Copyright (C) 2008 Jussi Mäki <joamaki@gmail.com>
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <memory.h>
 #include <assert.h>
 #include "util.h"
-#include "heap.h"
+#include "bitfile.h"
 #include "huffman.h"
+#include "heap.h"
+
+void huffman_code_table(const struct hctree *tree, struct hccode table[])
+{
+	/* Codes of all nodes; parents come after their children so going
+	   down from the root every parent code is ready before its
+	   children need it */
+	struct hccode codes[2*HC_MAX_SYMBOLS-1];
+	size_t i = tree->root + 1;
+
+	codes[tree->root].bits = 0;
+	codes[tree->root].len = 0;
+
+	while (i-- > 0) {
+		const struct hcnode *n = &tree->nodes[i];
 
-void huffman_make_codes(struct hcnode *root)
-{
-/* Macros for pushing the bitvector position forwards and backwards */
-#define BITS_FWD()             \
-	bit_pos++;             \
-	code_len++;            \
-	if (bit_pos > 7) {     \
-		pos++;         \
-		bit_pos = 0;   \
-	}
-
-#define BITS_BACK()            \
-	code_len--;            \
-	if (bit_pos < 1) {     \
-		pos--;         \
-		bit_pos = 7;   \
-	} else {               \
-		bit_pos--;     \
-	}
-
-	struct hcnode *n = root;
-	u8 code[32] = {0,};
-	int code_len = 0;
-	u8 *pos = code;
-	u8 bit_pos = 0;
-
-	while (1) {
-		while (n->left != NULL) {
-			/* going left (0), unset current bit */
-			BIT_UNSET(*pos, bit_pos);
-			BITS_FWD();
-			n = n->left;
+		if (i != tree->root) {
+			const struct hccode *p = &codes[n->parent];
+			int right = tree->nodes[n->parent].right == i;
+
+			codes[i].bits = (p->bits << 1) | right;
+			codes[i].len = p->len + 1;
 		}
 
-		/* Process the leaf node */
-		if (n->left == NULL && n->right == NULL) {
-			memcpy(n->code, code, 32);
-			n->code_len = code_len;
+		if (n->left == HC_NIL) {
+			if (codes[i].len > 64)
+				error("Code for character %d too long (%d bits)",
+				      n->character, codes[i].len);
+			table[n->character] = codes[i];
+		}
+	}
+}
 
-			/* go back one level */
-			BITS_BACK();
+/* Sorts 'n' symbols 'syms' by their frequency with a LSD radix sort,
+   one counting sort per byte of the largest frequency */
+static void sort_by_freq(const u64 freqs[], u16 syms[], size_t n)
+{
+	u16 tmp[HC_MAX_SYMBOLS];
+	size_t pos[256];
+	u64 max = 0;
+	size_t i;
+	int shift;
+
+	for (i=0; i<n; i++)
+		if (freqs[syms[i]] > max)
+			max = freqs[syms[i]];
+
+	for (shift=0; shift<64 && (max >> shift) != 0; shift+=8) {
+		size_t sum = 0;
+
+		memset(pos, 0, sizeof(pos));
+		for (i=0; i<n; i++)
+			pos[(freqs[syms[i]] >> shift) & 0xff]++;
+		for (i=0; i<256; i++) {
+			size_t c = pos[i];
+			pos[i] = sum;
+			sum += c;
 		}
+		for (i=0; i<n; i++)
+			tmp[pos[(freqs[syms[i]] >> shift) & 0xff]++] = syms[i];
+		memcpy(syms, tmp, n * sizeof(u16));
+	}
+}
 
-		while (n->parent != NULL) {
-			if (n != n->parent->right) {
-				/* going right (1), set current bit */
-				BIT_SET(*pos, bit_pos);
-				BITS_FWD();
-				n = n->parent->right;
-				break;
-			} else {
-				/* going up */
-				BITS_BACK();
-				n = n->parent;
-			}
+void huffman_count(const u8 *data, size_t len, u64 freqs[])
+{
+	u64 counts[4][256];
+	const u8 *end = data + len;
+	int c;
+
+	memset(counts, 0, sizeof(counts));
+
+	while (end - data >= 8) {
+		counts[0][data[0]]++;
+		counts[1][data[1]]++;
+		counts[2][data[2]]++;
+		counts[3][data[3]]++;
+		counts[0][data[4]]++;
+		counts[1][data[5]]++;
+		counts[2][data[6]]++;
+		counts[3][data[7]]++;
+		data += 8;
+	}
+	while (data < end)
+		counts[0][*data++]++;
+
+	for (c=0; c<256; c++)
+		freqs[c] += counts[0][c] + counts[1][c] +
+			    counts[2][c] + counts[3][c];
+}
+
+void huffman_lengths(const u64 freqs[], size_t count, u8 lens[])
+{
+	/* Nodes 0..n-1 are the sorted leaves, internal nodes follow in
+	   the order they are made, which is also by weight */
+	u64 weight[2*HC_MAX_SYMBOLS];
+	u16 parent[2*HC_MAX_SYMBOLS];
+	u8 depth[2*HC_MAX_SYMBOLS];
+	u16 syms[HC_MAX_SYMBOLS];
+	size_t n = 0, leaf = 0, inner, next, i;
+
+	assert(count <= HC_MAX_SYMBOLS);
+
+	memset(lens, 0, count);
+	for (i=0; i<count; i++)
+		if (freqs[i] > 0)
+			syms[n++] = i;
+
+	if (n == 0)
+		return;
+	if (n == 1) {
+		lens[syms[0]] = 1;
+		return;
+	}
+
+	sort_by_freq(freqs, syms, n);
+	for (i=0; i<n; i++)
+		weight[i] = freqs[syms[i]];
+
+	/* Take the two lightest of the leaf and internal node queues,
+	   preferring leaves on ties to keep the tree shallow */
+	inner = next = n;
+	for (; next < 2*n-1; next++) {
+		int k;
+
+		weight[next] = 0;
+		for (k=0; k<2; k++) {
+			size_t min;
+
+			if (leaf < n && (inner == next ||
+					 weight[leaf] <= weight[inner]))
+				min = leaf++;
+			else
+				min = inner++;
+
+			weight[next] += weight[min];
+			parent[min] = next;
+		}
+	}
+
+	/* Root is the last node; parents always come after children */
+	depth[2*n-2] = 0;
+	for (i=2*n-2; i-- > 0; )
+		depth[i] = depth[parent[i]] + 1;
+
+	for (i=0; i<n; i++)
+		lens[syms[i]] = depth[i];
+}
+
+void huffman_limit_lengths(u8 lens[], size_t count, int max_len)
+{
+	int count_len[256] = {0,};
+	int i, j, len, longest = 0;
+	size_t s, n, *order;
+
+	for (s=0; s<count; s++) {
+		count_len[lens[s]]++;
+		if (lens[s] > longest)
+			longest = lens[s];
+	}
+
+	if (longest <= max_len)
+		return;
+
+	/* Move the codes over the limit up (JPEG, Annex K.3): two codes of
+	   the longest length become one code a level up, pairing the other
+	   with a code split from the next level that has codes. */
+	for (i=longest; i>max_len; i--) {
+		while (count_len[i] > 0) {
+			j = i - 2;
+			while (count_len[j] == 0)
+				j--;
+
+			count_len[i] -= 2;
+			count_len[i-1]++;
+			count_len[j+1] += 2;
+			count_len[j]--;
 		}
+	}
+
+	/* Hand the new lengths out in the order of the old ones */
+	order = xmalloc(count * sizeof(size_t));
+	n = 0;
+	for (i=1; i<=longest; i++)
+		for (s=0; s<count; s++)
+			if (lens[s] == i)
+				order[n++] = s;
 
-		if (n->parent == NULL)
-			break;
+	len = 1;
+	for (s=0; s<n; s++) {
+		while (count_len[len] == 0)
+			len++;
+		count_len[len]--;
+		lens[order[s]] = len;
 	}
 
-#undef BITS_FWD
-#undef BITS_BACK
+	xfree(order);
 }
 
-struct hcnode ** huffman_init(u32 freqs[], int chars[], size_t count)
+int huffman_canonical_codes(const u8 lens[], size_t count,
+			    struct hccode codes[])
 {
-	int i;
-	struct hcnode **nodes = xmalloc(count*sizeof(struct hcnode *));
+	size_t count_len[65] = {0,};
+	u64 next[65];
+	u64 code = 0;
+	int i, len;
+
 	for (i=0; i<count; i++) {
-		nodes[i] = xmalloc(sizeof(struct hcnode));
-		nodes[i]->left = nodes[i]->right = nodes[i]->parent = NULL;
-		nodes[i]->frequency = freqs[i];
-		nodes[i]->character = chars[i];
-		nodes[i]->code_len = 0;
+		if (lens[i] > 64)
+			return -1;
+		count_len[lens[i]]++;
+	}
+
+	/* First code of each length, checking that the codes do not run
+	   out of the length (Kraft's inequality) */
+	count_len[0] = 0;
+	for (len=1; len<=64; len++) {
+		code = (code + count_len[len-1]) << 1;
+		next[len] = code;
+		if (count_len[len] > 0 && len < 64 &&
+		    ((code + count_len[len] - 1) >> len) != 0)
+			return -1;
+	}
+
+	for (i=0; i<count; i++) {
+		codes[i].len = lens[i];
+		codes[i].bits = lens[i] ? next[lens[i]]++ : 0;
+	}
+
+	return 0;
+}
+
+/* Marks entries of a decode table matching no code */
+#define DECODE_NONE 0xffff
+
+/* Appends a decode table of 'bits' index bits, returns its offset */
+static size_t add_decode_table(struct hcdecoder *dec, int bits)
+{
+	size_t i, off = dec->size;
+
+	dec->size += (size_t)1 << bits;
+	dec->table = xrealloc(dec->table, dec->size * sizeof(struct hcdecent));
+
+	for (i=off; i<dec->size; i++) {
+		dec->table[i].value = DECODE_NONE;
+		dec->table[i].len = 0;
+		dec->table[i].sub = 0;
+	}
+	return off;
+}
+
+/* Fills the table at 'off' indexed by the 'bits' bits following the
+   'plen' bits long code prefix 'prefix' */
+static void fill_decode_table(struct hcdecoder *dec, size_t off, int bits,
+			      u64 prefix, int plen,
+			      struct hccode codes[], size_t count)
+{
+	size_t i, j;
+
+	for (i=0; i<count; i++) {
+		int len = codes[i].len;
+		int rem = len - plen;
+
+		if (rem <= 0)
+			continue;
+		if (plen > 0 && (codes[i].bits >> rem) != prefix)
+			continue;
+
+		if (rem <= bits) {
+			/* Every index starting with the rest of the code */
+			size_t first = (size_t)(codes[i].bits &
+						(((u64)1 << rem) - 1)) << (bits - rem);
+
+			for (j=0; j < (size_t)1 << (bits - rem); j++) {
+				dec->table[off+first+j].value = i;
+				dec->table[off+first+j].len = rem;
+			}
+		} else {
+			/* Size the subtable for the longest code under it */
+			struct hcdecent *e;
+			int need = rem - bits;
+
+			e = &dec->table[off + ((codes[i].bits >> (rem - bits)) &
+					       (((u64)1 << bits) - 1))];
+			if (need > HC_DECODE_SUB_BITS)
+				need = HC_DECODE_SUB_BITS;
+			if (need > e->sub) {
+				e->sub = need;
+				e->len = bits;
+			}
+		}
+	}
+
+	for (j=0; j < (size_t)1 << bits; j++) {
+		size_t sub_off;
+		int sub = dec->table[off+j].sub;
+
+		if (!sub)
+			continue;
+
+		sub_off = add_decode_table(dec, sub);
+		if (sub_off > DECODE_NONE)
+			error("Decode table too large");
+		dec->table[off+j].value = sub_off;
+
+		fill_decode_table(dec, sub_off, sub, (prefix << bits) | j,
+				  plen + bits, codes, count);
 	}
-	return nodes;
 }
 
-static void free_nodes(struct hcnode *node)
+struct hcdecoder * huffman_decoder(struct hccode codes[], size_t count)
 {
-	struct hcnode *l, *r;
+	struct hcdecoder *dec = xmalloc(sizeof(struct hcdecoder));
+	int i, max_len = 1;
 
-	l = node->left;
-	r = node->right;
-	xfree(node);
+	for (i=0; i<count; i++)
+		if (codes[i].len > max_len)
+			max_len = codes[i].len;
 
-	if (l) free_nodes(l);
-	if (r) free_nodes(r);
+	dec->table = NULL;
+	dec->size = 0;
+	dec->multi = NULL;
+	dec->root_bits = max_len < HC_DECODE_BITS ? max_len : HC_DECODE_BITS;
+
+	add_decode_table(dec, dec->root_bits);
+	fill_decode_table(dec, 0, dec->root_bits, 0, 0, codes, count);
+
+	return dec;
+}
+
+void huffman_decoder_free(struct hcdecoder *dec)
+{
+	if (dec->multi)
+		xfree(dec->multi);
+	xfree(dec->table);
+	xfree(dec);
+}
+
+int huffman_decode(struct hcdecoder *dec, struct bitfile *bf)
+{
+	struct hcdecent *e;
+	int avail = bitfile_refill_bits(bf);
+
+	e = &dec->table[bitfile_peek_bits(bf, dec->root_bits)];
+
+	/* Codes longer than the root table go through subtables */
+	while (e->sub) {
+		if (e->len > avail)
+			return HC_DECODE_END;
+		bitfile_consume_bits(bf, e->len);
+		avail = bitfile_refill_bits(bf);
+		e = &dec->table[e->value + bitfile_peek_bits(bf, e->sub)];
+	}
+
+	if (e->value == DECODE_NONE)
+		return HC_DECODE_INVALID;
+	if (e->len > avail)
+		return HC_DECODE_END;
+
+	bitfile_consume_bits(bf, e->len);
+	return e->value;
+}
+
+/* Bit reader of one substream for huffman_decode_streams() */
+struct streamreader {
+	const u8 *pos, *end;
+	u64 bits;  /* Left aligned like the container of a bitfile */
+	int count; /* Bits in 'bits' */
+	int over;  /* Zero bits added past the end */
+};
+
+/* Top up 'r' to at least 56 bits, reading zeros past the end */
+static void stream_refill(struct streamreader *r)
+{
+	if (r->end - r->pos >= 8) {
+		r->bits |= LOAD_BE64(r->pos) >> r->count;
+		r->pos += (63 - r->count) >> 3;
+		r->count |= 56;
+		return;
+	}
+
+	while (r->count <= 56) {
+		if (r->pos < r->end)
+			r->bits |= (u64)*r->pos++ << (56 - r->count);
+		else
+			r->over += 8;
+		r->count += 8;
+	}
+}
+
+/* Decode a symbol from a refilled 'r' */
+static int stream_decode(const struct hcdecoder *dec,
+			 struct streamreader *r)
+{
+	const struct hcdecent *e = &dec->table[r->bits >> (64 - dec->root_bits)];
+
+	while (e->sub) {
+		r->bits <<= e->len;
+		r->count -= e->len;
+		stream_refill(r);
+		e = &dec->table[e->value + (r->bits >> (64 - e->sub))];
+	}
+
+	r->bits <<= e->len;
+	r->count -= e->len;
+	return e->value;
+}
+
+int huffman_decode_streams(struct hcdecoder *dec, const u8 *src,
+			   const size_t lens[], int count,
+			   u8 *out, size_t n)
+{
+	struct streamreader r[HC_MAX_STREAMS];
+	size_t i;
+	int k, bad = 0;
+
+	assert(count > 0 && count <= HC_MAX_STREAMS);
+
+	for (k=0; k<count; k++) {
+		r[k].pos = src;
+		r[k].end = src += lens[k];
+		r[k].bits = 0;
+		r[k].count = r[k].over = 0;
+	}
+
+	i = 0;
+
+	/* A single substream goes several short codes per lookup */
+	if (count == 1 && dec->multi) {
+		while (i + HC_MULTI_SYMS <= n) {
+			const struct hcmultient *m;
+			int c;
+
+			stream_refill(&r[0]);
+			m = &dec->multi[r[0].bits >> (64 - dec->root_bits)];
+			if (m->count == 0) {
+				c = stream_decode(dec, &r[0]);
+				bad |= c > 0xff;
+				out[i++] = c;
+				continue;
+			}
+			memcpy(out + i, m->syms, HC_MULTI_SYMS);
+			r[0].bits <<= m->len;
+			r[0].count -= m->len;
+			i += m->count;
+		}
+	}
+
+	/* One symbol from each substream per round; the substreams do not
+	   depend on each other so their lookups overlap */
+	for (; i + count <= n; ) {
+		for (k=0; k<count; k++, i++) {
+			int c;
+
+			stream_refill(&r[k]);
+			c = stream_decode(dec, &r[k]);
+			bad |= c > 0xff;
+			out[i] = c;
+		}
+	}
+	for (k=0; i<n; k++, i++) {
+		int c;
+
+		stream_refill(&r[k]);
+		c = stream_decode(dec, &r[k]);
+		bad |= c > 0xff;
+		out[i] = c;
+	}
+
+	/* Consumed bits must not reach into the zeros after the end */
+	for (k=0; k<count; k++)
+		bad |= r[k].count < r[k].over;
+
+	return bad;
 }
 
-void huffman_deinit(struct hcnode **nodes, struct hcnode *root)
+int huffman_decode_context(struct hcdecoder *decs[], const u8 map[],
+			   const u8 *src, size_t len, u8 *out, size_t n)
 {
-	free_nodes(root);
-	xfree(nodes);
+	struct streamreader r;
+	size_t i;
+	int c, bad = 0;
+	u8 prev = 0;
+
+	r.pos = src;
+	r.end = src + len;
+	r.bits = 0;
+	r.count = r.over = 0;
+
+	for (i=0; i<n; i++) {
+		stream_refill(&r);
+		c = stream_decode(decs[map[prev]], &r);
+		bad |= c > 0xff;
+		out[i] = prev = c;
+	}
+
+	return bad | (r.count < r.over);
 }
 
-struct hcnode * huffman(struct hcnode **nodes, size_t count)
+double huffman_decoder_multi(struct hcdecoder *dec, double min_syms)
+{
+	size_t size = (size_t)1 << dec->root_bits;
+	size_t i, total = 0;
+
+	if (!dec->multi)
+		dec->multi = xmalloc(size * sizeof(struct hcmultient));
+
+	/* Decode greedily from each index with the root table, the bits
+	   after the index read as zero so a code that fits still matches */
+	for (i=0; i<size; i++) {
+		struct hcmultient *m = &dec->multi[i];
+		int pos = 0;
+
+		m->count = m->len = 0;
+		while (m->count < HC_MULTI_SYMS) {
+			struct hcdecent *e = &dec->table[(i << pos) & (size-1)];
+
+			if (e->sub || e->value > 0xff ||
+			    pos + e->len > dec->root_bits)
+				break;
+			m->syms[m->count++] = e->value;
+			pos += e->len;
+		}
+		m->len = pos;
+		total += m->count;
+	}
+
+	/* Not worth a lookup that mostly falls back to huffman_decode() */
+	if ((double)total / size < min_syms) {
+		xfree(dec->multi);
+		dec->multi = NULL;
+	}
+
+	return (double)total / size;
+}
+
+int huffman_decode_multi(struct hcdecoder *dec, struct bitfile *bf,
+			 u8 out[HC_MULTI_SYMS])
+{
+	struct hcmultient *m;
+	int avail = bitfile_refill_bits(bf);
+
+	m = &dec->multi[bitfile_peek_bits(bf, dec->root_bits)];
+	if (m->len > avail)
+		return 0;
+
+	bitfile_consume_bits(bf, m->len);
+	memcpy(out, m->syms, HC_MULTI_SYMS);
+	return m->count;
+}
+
+struct hctree * huffman_new(void)
+{
+	struct hctree *tree = xmalloc(sizeof(struct hctree));
+	tree->count = 0;
+	tree->root = HC_NIL;
+	return tree;
+}
+
+void huffman_free(struct hctree *tree)
+{
+	xfree(tree);
+}
+
+void huffman_init(struct hctree *tree, const u32 freqs[], const int chars[],
+		  size_t count)
 {
-	struct heap *heap;
-	struct hcnode *z, *x, *y;
-	struct hcnode *root;
 	int i;
 
-	heap = heap_build(nodes, count);
-	for(i=0; i<count-1; i++) {
-		z = xmalloc(sizeof(struct hcnode));
-		x = z->left = heap_extract_min(heap);
-		y = z->right = heap_extract_min(heap);
-		z->frequency = x->frequency + y->frequency;
-		x->parent = y->parent = z;
-		z->parent = NULL;
-		heap_insert(heap, z);
+	if (count < 1 || count > HC_MAX_SYMBOLS)
+		error("Cannot build a tree of %d characters", (int)count);
+
+	for (i=0; i<count; i++) {
+		struct hcnode *n = &tree->nodes[i];
+		n->left = n->right = n->parent = HC_NIL;
+		n->frequency = freqs[i];
+		n->character = chars[i];
+	}
+	tree->count = count;
+	tree->root = HC_NIL;
+}
+
+u16 huffman(struct hctree *tree)
+{
+	struct heap heap;
+	u16 leaves[HC_MAX_SYMBOLS];
+	size_t i, next = tree->count;
+
+	for (i=0; i<tree->count; i++)
+		leaves[i] = i;
+
+	heap_build(&heap, tree->nodes, leaves, tree->count);
+	for(i=0; i<tree->count-1; i++, next++) {
+		struct hcnode *z = &tree->nodes[next];
+		u16 x = z->left = heap_extract_min(&heap);
+		u16 y = z->right = heap_extract_min(&heap);
+		z->frequency = tree->nodes[x].frequency + tree->nodes[y].frequency;
+		tree->nodes[x].parent = tree->nodes[y].parent = next;
+		z->parent = HC_NIL;
+		z->character = HC_NIL;
+		heap_insert(&heap, next);
 	}
 
-	root = heap_extract_min(heap);
-	heap_free(heap);
-	return root;
+	tree->root = heap_extract_min(&heap);
+	return tree->root;
 }
@@ -7,41 +7,160 @@
 #ifndef __HUFFMAN_H
 #define __HUFFMAN_H
 
-struct hcnode {
-	/* Tree pointers */
-	struct hcnode *left, *right;
-	struct hcnode *parent;
+/* Most symbols a tree or huffman_lengths() handles */
+#define HC_MAX_SYMBOLS 512
+
+/* Index of no node */
+#define HC_NIL 0xffff
 
+/* Node of a Huffman tree. Nodes refer to each other by their index in
+   the node array of the tree. */
+struct hcnode {
 	u32 frequency;
-	int character; /* Only leaves have this */
-
-	/* 32 bytes is enough, the tree has at maximum 257 leaves
-	   (256 chars + EOF) so the code length (path through the tree) can
-	   be then at maximum 256 bits since the tree is full:
-
-  	    O
-	   / \
-	  O   O    This presents the full tree of maximum depth:
-	     / \    4 leaves and the longest path is (LEAVES-1) 3.
-	    O   O
-	       / \
-	      O   O
-	*/
-
-	u8 code[32];
-	int code_len; /* Code length in bits */
+	u16 left, right; /* Children, HC_NIL for leaves */
+	u16 parent;      /* HC_NIL for the root */
+	u16 character;   /* Only leaves have this */
+};
+
+/* Huffman tree in one array: 'count' leaves first, then the internal
+   nodes in the order huffman() makes them. Reusable for any number of
+   builds. */
+struct hctree {
+	struct hcnode nodes[2*HC_MAX_SYMBOLS-1];
+	size_t count; /* Leaves */
+	u16 root;
+};
+
+/* Flat per-symbol code for the encoder. The code is held in the low
+   'len' bits of 'bits', first bit of the code as the most significant. */
+struct hccode {
+	u64 bits;
+	int len;
+};
+
+/* Number of bits looked up at once by the first level of a decode table */
+#define HC_DECODE_BITS 11
+
+/* Most index bits of a decode subtable; longer codes chain further
+   subtables */
+#define HC_DECODE_SUB_BITS 8
+
+/* Entry of a decode table. Codes no longer than the index bits of the
+   table resolve to a symbol directly; longer ones link to a subtable
+   indexed by the bits that follow. */
+struct hcdecent {
+	u16 value; /* Symbol, or offset of the subtable if 'sub' is set */
+	u8 len;    /* Bits consumed at this level */
+	u8 sub;    /* Index bits of the subtable, 0 for symbols */
+};
+
+/* Most symbols resolved by one lookup in a multi-symbol table */
+#define HC_MULTI_SYMS 4
+
+/* Entry of a multi-symbol table: the byte symbols whose codes fit in
+   the index bits one after another. 'count' is 0 when the first code
+   is longer than the index or is not a byte. */
+struct hcmultient {
+	u8 syms[HC_MULTI_SYMS];
+	u8 count; /* Symbols in 'syms' */
+	u8 len;   /* Bits of all their codes */
+};
+
+/* Table-driven decoder: the root table is followed by the subtables */
+struct hcdecoder {
+	struct hcdecent *table;
+	size_t size;   /* Entries in table */
+	int root_bits; /* Index bits of the root and multi-symbol tables */
+	struct hcmultient *multi; /* NULL unless huffman_decoder_multi()
+				     kept one */
 };
 
+/* Return values of huffman_decode() besides symbols */
+#define HC_DECODE_END (-1)     /* Input ended within a code */
+#define HC_DECODE_INVALID (-2) /* Bits match no code */
+
+struct bitfile;
+
+/* Allocate an empty tree */
+struct hctree * huffman_new(void);
+
+/* Free a tree */
+void huffman_free(struct hctree *tree);
+
 /* Initializes 'count' one node trees, one for each character */
-struct hcnode ** huffman_init(u32 freqs[], int chars[], size_t count);
+void huffman_init(struct hctree *tree, const u32 freqs[], const int chars[],
+		  size_t count);
+
+/* The huffman's algorithm. Returns index of the root of the tree */
+u16 huffman(struct hctree *tree);
+
+/* Fill 'table', indexed by character, with the codes of the tree built
+   by huffman(): left is 0, right is 1. Entries of characters not in the
+   tree are left untouched. */
+void huffman_code_table(const struct hctree *tree, struct hccode table[]);
+
+/* Add the number of times each byte value occurs in the 'len' bytes at
+   'data' to 'freqs' (256 entries). Bytes are counted into four tables
+   in turn, so runs of one value do not wait on a single counter. */
+void huffman_count(const u8 *data, size_t len, u64 freqs[]);
+
+/* Compute Huffman code lengths 'lens' for 'count' symbols with
+   frequencies 'freqs' (0 for unused symbols) in linear time: the leaves
+   are sorted with a radix sort and the tree is built with two queues over
+   flat arrays, without building a tree of nodes. */
+void huffman_lengths(const u64 freqs[], size_t count, u8 lens[]);
+
+/* Limit code lengths 'lens' (0 for unused symbols) of a complete prefix
+   code to at most 'max_len' bits, keeping the code complete. Codes that
+   were the shortest stay the shortest. 2^max_len must be at least the
+   number of symbols in use. */
+void huffman_limit_lengths(u8 lens[], size_t count, int max_len);
+
+/* Assign canonical codes to symbols with code lengths 'lens' (0 for
+   unused symbols): codes of each length are consecutive in symbol order,
+   shorter codes first. Returns -1 if the lengths do not make a prefix
+   code. */
+int huffman_canonical_codes(const u8 lens[], size_t count,
+			    struct hccode codes[]);
+
+/* Build a decoder for the codes in 'codes', indexed by symbol. Symbols
+   with code length 0 are not in use. */
+struct hcdecoder * huffman_decoder(struct hccode codes[], size_t count);
+
+/* Frees a decoder */
+void huffman_decoder_free(struct hcdecoder *dec);
+
+/* Decode the next symbol from 'bf' */
+int huffman_decode(struct hcdecoder *dec, struct bitfile *bf);
+
+/* Most substreams huffman_decode_streams() interleaves */
+#define HC_MAX_STREAMS 8
+
+/* Decode 'n' byte symbols into 'out' from 'count' substreams stored one
+   after another at 'src', 'lens' bytes each. Symbol i comes from
+   substream i % count, so the substreams are decoded side by side.
+   A single substream is decoded with the multi-symbol table once
+   huffman_decoder_multi() has built it. Returns non-zero if a code is
+   invalid, is not a byte or runs past the end of its substream. */
+int huffman_decode_streams(struct hcdecoder *dec, const u8 *src,
+			   const size_t lens[], int count,
+			   u8 *out, size_t n);
 
-/* Frees allocated resources */
-void huffman_deinit(struct hcnode **nodes, struct hcnode *root);
+/* Decode 'n' byte symbols into 'out' from the 'len' bytes at 'src',
+   each with the decoder decs[map[previous symbol]] (the first as if
+   after a 0). Returns non-zero as huffman_decode_streams() does. */
+int huffman_decode_context(struct hcdecoder *decs[], const u8 map[],
+			   const u8 *src, size_t len, u8 *out, size_t n);
 
-/* The huffman's algorithm. Returns pointer to the root of the tree */
-struct hcnode * huffman(struct hcnode **nodes, size_t count);
+/* Add a multi-symbol table to 'dec' if on average it resolves at least
+   'min_syms' symbols per lookup, weighting each code by 2^-length;
+   otherwise 'dec' is left without one. Returns that average. */
+double huffman_decoder_multi(struct hcdecoder *dec, double min_syms);
 
-/* Generate prefix codes by traversing the tree */
-void huffman_make_codes(struct hcnode *root);
+/* Decode up to HC_MULTI_SYMS byte symbols from 'bf' into 'out' with
+   one lookup and return their number. Returns 0 without consuming any
+   input when the next code needs huffman_decode(). */
+int huffman_decode_multi(struct hcdecoder *dec, struct bitfile *bf,
+			 u8 out[HC_MULTI_SYMS]);
 
 #endif
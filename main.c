@@ -16,16 +16,18 @@
  * Decompressing a file:
  * $ hcpak -d myfile.hc
  *
- * == File format ==
- * - Magic (5 bytes): HCPAK
- * - Frequency/Character table len: 8-bit integer. This is 1 less then true
- *                                  length so it can be stored in 8-bit integer.
- *                                  This also means that we cannot compress empty
- *                                  files.
- * - Frequency/Character table: [{char, freq}, ...]; each entry is 1+32 bytes,
- *                              full alphabet being 256*33 = 8448 bytes.
- * - Data ...
- * - EOF marked by EOFCHAR (code depends on Huffman's)
+ * Compressing a pipe:
+ * $ producer | hcpak - > data.hc
+ *
+ * Compressing small records with a dictionary trained on samples of them:
+ * $ hcpak --train records.dict samples
+ * $ hcpak -D records.dict record1
+ * $ hcpak -d -D records.dict record1.hc
+ *
+ * Decompressing 100 MB from offset 3 GB of a file coded in blocks:
+ * $ hcpak --range 3G:100M myfile.hc > slice
+ *
+ * The file format is described in hcpak.c.
  */
 
 #include <stdio.h>
@@ -35,8 +37,8 @@
 #include <stdlib.h>
 
 #include "util.h"
-#include "huffman.h"
 #include "bitfile.h"
+#include "hcpak.h"
 
 /* Files */
 static struct bitfile *filein = NULL;
@@ -49,45 +51,135 @@ static int verbose = 0;
 static int decompression = 0;
 static int force = 0;
 
-/* File magic */
-#define MAGIC_LEN 5
-static const u8 *magic = (u8*) "HCPAK";
+/* Dictionary table file written by --train or read with -D */
+static char *train_name = NULL;
+static struct hcpak_dict *dict = NULL;
 
-/* Maximum character count */
-#define MAX_CHARS 257
+/* Range to decompress with --range */
+static int range = 0;
+static u64 range_start, range_len;
 
-/* Character for representing EOF for the file */
-#define EOFCHAR (MAX_CHARS)
+/* Compression options */
+static struct hcpak_options options;
 
-/* Header size */
-#define HEADER_LEN (MAGIC_LEN+1)
+/* Chunk size for asynchronous output */
+#define IO_CHUNK_LEN (1024*1024)
 
 static void usage(const char *prog)
 {
 	printf("Compress or decompress files using Huffman's algorithm.\n");
 	printf("Usage: %s [OPTIONS] INPUTFILE\n", prog);
 	printf("Options:\n");
+	printf("\t-a\t\tUse an adaptive code, reading input only once\n");
+	printf("\t-b KBYTES\tCode in blocks of KBYTES KB (%d-%d, default %d, "
+	       "0 for one code)\n", HCPAK_MIN_BLOCK_LEN / 1024,
+	       HCPAK_MAX_BLOCK_LEN / 1024, HCPAK_DEFAULT_BLOCK_LEN / 1024);
+	printf("\t-c\t\tCode blocks with codes chosen by the previous "
+	       "byte\n");
 	printf("\t-d\t\tDecompress input file\n");
+	printf("\t-D TABLE\tCode with the dictionary in TABLE\n");
+	printf("\t-F\t\tFast: build codes from samples of the input\n");
 	printf("\t-h\t\tPrint this help\n");
+	printf("\t-i\t\tEnd blocks with a seek index for --range\n");
+	printf("\t-L BITS\t\tLimit codes to BITS bits (%d-%d, default %d)\n",
+	       HCPAK_MIN_CODE_LEN, HCPAK_MAX_CODE_LEN, HCPAK_DEFAULT_CODE_LEN);
+	printf("\t-s STREAMS\tInterleave STREAMS substreams (1-%d, default %d)\n",
+	       HCPAK_MAX_STREAMS, HCPAK_DEFAULT_STREAMS);
+	printf("\t-T THREADS\tCode blocks or count frequencies with THREADS "
+	       "threads (1-%d)\n",
+	       HCPAK_MAX_THREADS);
 	printf("\t-v\t\tVerbose mode\n");
+	printf("\t--range START:LEN\n\t\t\tWrite LEN bytes from START of a "
+	       "file coded in blocks\n\t\t\tto standard output (K, M and G "
+	       "suffixes allowed)\n");
+	printf("\t--train TABLE\tTrain a dictionary on INPUTFILE and save "
+	       "it in TABLE\n");
 	printf("\nProgram defaults to compression. "
 	       "Compression and decompression are done in-place.\n");
+	printf("INPUTFILE - reads standard input and writes standard output.\n");
 	exit(0);
 }
 
+/* Parse a byte count with an optional K, M or G suffix, ending at 'end'.
+   Returns the rest of the string. */
+static const char * parse_size(const char *str, u64 *size, int end)
+{
+	const char *p = str;
+
+	*size = 0;
+	for (; *p >= '0' && *p <= '9'; p++)
+		*size = *size * 10 + (*p - '0');
+
+	switch (*p) {
+	case 'K':
+		*size <<= 10;
+		p++;
+		break;
+	case 'M':
+		*size <<= 20;
+		p++;
+		break;
+	case 'G':
+		*size <<= 30;
+		p++;
+		break;
+	}
+
+	if (p == str || *p != end)
+		error("Invalid size '%s'.", str);
+	return p;
+}
+
+/* Code with the dictionary in table file 'name' */
+static void load_dict(char *name)
+{
+	struct bitfile *bf = bitfile_open(name, "rb");
+
+	hcpak_dict_free(dict);
+	dict = hcpak_dict_load(bf);
+	options.dict = dict;
+	bitfile_close(bf);
+}
+
+/* Options taking a value, either joined (-L11) or as the next argument */
+static const char *value_options = "LsbTD";
+
 static void parse_args(int argc, char **argv)
 {
-	int idx = 1;
+	int idx;
 	if (argc < 2) {
 		usage(argv[0]);
 		return;
 	}
-	argc--;
-	while (argc > 0) {
-		if (argv[idx][0] == '-') {
-			int len = strlen(argv[idx])-1;
-			while (len > 0) {
-				switch (argv[idx][len]) {
+	hcpak_default_options(&options);
+	for (idx=1; idx<argc; idx++) {
+		char *arg = argv[idx];
+		if (!strcmp(arg, "--range")) {
+			const char *p;
+
+			if (idx+1 == argc)
+				error("Option --range needs a value.");
+			p = parse_size(argv[++idx], &range_start, ':');
+			parse_size(p + 1, &range_len, '\0');
+			range = 1;
+		} else if (!strcmp(arg, "--train")) {
+			if (idx+1 == argc)
+				error("Option --train needs a value.");
+			train_name = argv[++idx];
+		} else if (arg[0] == '-' && arg[1] != '\0') {
+			while (*++arg != '\0') {
+				char *value = NULL;
+
+				if (strchr(value_options, *arg)) {
+					if (arg[1] != '\0')
+						value = arg + 1;
+					else if (idx+1 < argc)
+						value = argv[++idx];
+					else
+						error("Option -%c needs a value.", *arg);
+				}
+
+				switch (*arg) {
 				case 'h':
 					usage(argv[0]);
 					break;
@@ -100,226 +192,179 @@ static void parse_args(int argc, char **argv)
 				case 'd':
 					decompression = 1;
 					break;
+				case 'i':
+					options.index = 1;
+					break;
+				case 'F':
+					options.sample = 1;
+					break;
+				case 'c':
+					options.context = 1;
+					break;
+				case 'a':
+					options.adaptive = 1;
+					break;
+				case 'L':
+					options.max_code_len = atoi(value);
+					break;
+				case 's':
+					options.streams = atoi(value);
+					break;
+				case 'b':
+					options.block_len = atoi(value) * 1024;
+					break;
+				case 'T':
+					options.threads = atoi(value);
+					break;
+				case 'D':
+					load_dict(value);
+					break;
 				}
-				len--;
+
+				/* The value took the rest of the argument */
+				if (value)
+					break;
 			}
 		} else {
 			/* Filename */
 			if (NULL == filein) {
-				filein_name = argv[idx];
+				filein_name = arg;
 			} else {
 				error("Input file already specified!");
 			}
 		}
-		idx++;
-		argc--;
 	}
 
 	if (NULL == filein_name)
 		usage(argv[0]);
 
-	if (decompression) {
+	if (!strcmp(filein_name, "-")) {
+		u64 size;
+
+		filein = bitfile_from_file(stdin, "rb");
+
+		/* A single code for the whole input needs a second pass */
+		if (!decompression && !train_name && !options.block_len &&
+		    !options.adaptive && !options.dict &&
+		    bitfile_size(filein, &size) != 0)
+			error("Compressing a pipe needs blocks (-b) or the "
+			      "adaptive code (-a).");
+		if (train_name)
+			fileout = bitfile_open(train_name, "wb");
+		else
+			fileout = bitfile_from_file(stdout, "wb");
+	} else if (range) {
+		/* The input stays, the range goes to standard output */
+		filein = bitfile_open_mmap(filein_name);
+		fileout = bitfile_from_file(stdout, "wb");
+	} else if (train_name) {
+		/* The input stays, the dictionary goes to its own file */
+		filein = bitfile_open_mmap(filein_name);
+		fileout = bitfile_open(train_name, "wb");
+	} else if (decompression) {
 		size_t len = strlen(filein_name);
 		len = strlen(filein_name);
 		if (!force && len > 3 && strncmp(filein_name + len-3, ".hc", 3))
 			error("Input file has unknown suffix, refusing to decompress.");
 
-		filein = bitfile_open(filein_name, "rb");
+		filein = bitfile_open_mmap(filein_name);
 
 		fileout_name = xmalloc(len-3 + 1);
 		memset(fileout_name, 0, len-3 + 1);
 		strncpy(fileout_name, filein_name, len-3);
-		fileout = bitfile_open(fileout_name, "wb");
+		fileout = bitfile_open_async(fileout_name, "wb", IO_CHUNK_LEN);
 	} else {
 		size_t len = strlen(filein_name);
 		if (!force && len > 3 && !strncmp(filein_name + len - 3, ".hc", 3))
 			error("File already compressed, refusing to compress.");
 
-		filein = bitfile_open(filein_name, "rb");
+		filein = bitfile_open_mmap(filein_name);
 
 		fileout_name = xmalloc(len+3 + 1);
 		memset(fileout_name, 0, len+3 + 1);
 		strcpy(fileout_name, filein_name);
 		strcat(fileout_name, ".hc");
-		fileout = bitfile_open(fileout_name, "wb");
-	}
-}
-
-static void calculate_frequencies (struct bitfile *bf, u32 *out_freqs,
-				   int *out_chars, int *out_len)
-{
-	u8 res;
-	int i;
-	u32 freqs[MAX_CHARS+1] = {0,};
-
-	while (1) {
-		if (bitfile_get_byte(bf, &res) != 0) break;
-		freqs[res]++;
-	}
-
-	*out_len = 0;
-	for (i=0; i<MAX_CHARS+1; i++) {
-		if (freqs[i] > 0) {
-			out_chars[*out_len] = i;
-			out_freqs[*out_len] = freqs[i];
-			(*out_len)++;
-		}
+		fileout = bitfile_open_async(fileout_name, "wb", IO_CHUNK_LEN);
 	}
 }
 
 static int compress(void)
 {
-	u32 freqs[MAX_CHARS] = {0,};
-	int chars[MAX_CHARS] = {0,};
-	int freqtable_len = 0;
-	struct hcnode *lookup[MAX_CHARS+1];
-	struct hcnode **nodes;
-	struct hcnode *root;
-	int i;
-	u8 byte;
-	double orig_len = 0, new_len = 0;
+	struct hcpak_stats stats;
 
 	if (verbose)
 		fprintf(stderr, "Compressing '%s' ... ", filein_name);
 
-	calculate_frequencies(filein, freqs, chars, &freqtable_len);
-
-	if (freqtable_len < 1)
-		error("Compressing empty files is not supported.");
-
-	/* Write magic */
-	bitfile_put_bytes(fileout, (u8*)magic, MAGIC_LEN);
-
-	/* Write frequency table */
-	bitfile_put_byte(fileout, freqtable_len-1);
-	for(i=0; i<freqtable_len; i++) {
-		bitfile_put_byte(fileout, chars[i]);
-		bitfile_put_u32(fileout, freqs[i]);
-	}
-
-	freqs[freqtable_len] = 1;
-	chars[freqtable_len] = EOFCHAR;
-	freqtable_len++;
-
-	nodes = huffman_init(freqs, chars, freqtable_len);
-	root = huffman(nodes, freqtable_len);
-	huffman_make_codes(root);
-
-	/* Construct lookup table for quick code lookups */
-	for(i=0; i<freqtable_len; i++) {
-		lookup[nodes[i]->character] = nodes[i];
-	}
-
-	/* Write data */
-	bitfile_rewind(filein);
-
-	while(bitfile_get_byte(filein, &byte) == 0) {
-		bitfile_put_bits(fileout, lookup[byte]->code, lookup[byte]->code_len);
-		orig_len += 8;
-		new_len += lookup[byte]->code_len;
-	}
-
-	/* Write pseudo-EOF marker */
-	bitfile_put_bits(fileout, lookup[EOFCHAR]->code, lookup[EOFCHAR]->code_len);
-
-	huffman_deinit(nodes, root);
-
-	/* Remove source file */
-	unlink(filein_name);
+	hcpak_compress(filein, fileout, &options, &stats);
 
 	bitfile_close(filein);
 	bitfile_close(fileout);
 
+	/* Remove source file, only once the output closed without error */
+	if (fileout_name)
+		unlink(filein_name);
+
 	if (verbose)
-		fprintf(stderr, "done, %.1f%%.\n", 100 * (1 - (new_len / orig_len)));
+		fprintf(stderr, "done, %.1f%%.\n",
+			100 * (1 - (stats.out_bits / stats.in_bits)));
 
 	return 0;
 }
 
 static int decompress(void)
 {
-
-	u32 freqs[MAX_CHARS];
-	int chars[MAX_CHARS];
-	int freqtable_len = 0;
-	struct hcnode **nodes;
-	struct hcnode *root;
-	struct hcnode *n;
-	int i;
-	u8 byte;
-	u8 magicbuf[MAGIC_LEN];
-	double orig_len = 0, new_len = 0;
+	struct hcpak_stats stats;
 
 	if (verbose)
 		fprintf(stderr, "Decompressing '%s' ... ", filein_name);
 
-	/* Check magic */
-	if (bitfile_get_bytes(filein, magicbuf, MAGIC_LEN) != 0)
-		error("Input too short!");
-
-	if (memcmp(magicbuf, magic, MAGIC_LEN) != 0)
-		error("Magic mismatch on input!");
-
-	/* Get frequency table length */
-	if (bitfile_get_byte(filein, &byte) != 0)
-		error("Input too short!");
+	hcpak_decompress(filein, fileout, &options, &stats);
 
-	/* NB: Frequency table length is stored as 1 less then true length so that we
-	   can store the length 256 in 8-bit integer (range 0-255). */
-	freqtable_len = byte + 1;
-
-	/* Get frequency table */
-	for (i=0; i<freqtable_len; i++) {
-		if (bitfile_get_byte(filein, &byte) != 0)
-			error("Input too short!");
-
-		chars[i] = byte;
-		if (bitfile_get_u32(filein, &freqs[i]) != 0)
-			error("Input too short!");
-	}
+	bitfile_close(filein);
+	bitfile_close(fileout);
 
-	freqs[freqtable_len] = 1;
-	chars[freqtable_len] = EOFCHAR;
-	freqtable_len++;
+	/* Remove source file, only once the output closed without error */
+	if (fileout_name)
+		unlink(filein_name);
 
-	nodes = huffman_init(freqs, chars, freqtable_len);
-	root = huffman(nodes, freqtable_len);
-	n = root;
+	if (verbose)
+		fprintf(stderr, "done, %.1f%%.\n",
+			100 * (1 - (stats.out_bits / stats.in_bits)));
 
-	/* Decompress input by traversing the prefix code tree until we reach a leaf */
-	while(1) {
-		if (bitfile_get_bit(filein, &byte) != 0)
-			break;
+	return 0;
+}
 
-		orig_len++;
+static int train(void)
+{
+	struct hcpak_dict *trained;
 
-		if (byte) n = n->right;
-		else n = n->left;
+	trained = hcpak_dict_train(filein, &options);
+	hcpak_dict_save(trained, fileout);
 
-		if (n == NULL)
-			error("Code not found! File corrupted?");
+	bitfile_close(filein);
+	bitfile_close(fileout);
 
-		/* Did we reach a leaf? */
-		if (!n->right && !n->left) {
-			if (n->character == EOFCHAR)
-				break;
+	if (verbose)
+		fprintf(stderr, "Trained dictionary %08x on '%s'.\n",
+			hcpak_dict_id(trained), filein_name);
 
-			bitfile_put_byte(fileout, (u8) n->character);
-			new_len+=8;
-			n = root;
-		}
-	}
+	hcpak_dict_free(trained);
+	return 0;
+}
 
-	huffman_deinit(nodes, root);
+static int decompress_range(void)
+{
+	struct hcpak_stats stats;
 
-	/* Remove source file */
-	unlink(filein_name);
+	hcpak_decompress_range(filein, fileout, range_start, range_len,
+			       &stats);
 
 	bitfile_close(filein);
 	bitfile_close(fileout);
 
 	if (verbose)
-		fprintf(stderr, "done, %.1f%%.\n", 100 * (1 - (new_len / orig_len)));
+		fprintf(stderr, "Read %.0f bytes for %.0f bytes of '%s'.\n",
+			stats.in_bits / 8, stats.out_bits / 8, filein_name);
 
 	return 0;
 }
@@ -330,12 +375,17 @@ int main(int argc, char **argv)
 
 	parse_args(argc, argv);
 
-	if (decompression)
+	if (train_name)
+		ret = train();
+	else if (range)
+		ret = decompress_range();
+	else if (decompression)
 		ret = decompress();
 	else
 		ret = compress();
 
 	xfree(fileout_name);
+	hcpak_dict_free(dict);
 
 	return ret;
 }
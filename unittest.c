@@ -7,103 +7,384 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <unistd.h>
 #include "util.h"
-#include "heap.h"
 #include "huffman.h"
+#include "heap.h"
+#include "adaptive.h"
 #include "bitfile.h"
+#include "hcpak.h"
 
-static u32 bits_to_integer(u8 *bits, int bit_count)
+void test_heap(void)
 {
-        u32 out = 0;
-        u8 bit_pos = 0;
-        if (bit_count > 32) return -1;
-
-        while (bit_count > 0) {
-                if (bit_pos > 7) {
-                        bits++;
-                        bit_pos = 0;
-                }
-
-                /* set the rightmost bit */
-                out |= !!(*bits & (1 << (7-bit_pos)));
-                bit_pos++;
-                bit_count--;
-
-                /* shift the output left by one bit */
-                if (bit_count) out = out << 1;
-        }
-        return out;
+	struct heap h;
+	struct hcnode nodes[5];
+	u16 items[5] = {0, 1, 2, 3, 4};
+	nodes[3].frequency = 4;
+	nodes[4].frequency = 5;
+	nodes[1].frequency = 2;
+	nodes[2].frequency = 3;
+	nodes[0].frequency = 1;
+	heap_build(&h, nodes, items, 5);
+
+	assert (0 == heap_extract_min(&h));
+	assert (1 == heap_extract_min(&h));
+	assert (2 == heap_extract_min(&h));
+	assert (3 == heap_extract_min(&h));
+	assert (4 == heap_extract_min(&h));
+	assert (h.count == 0);
 }
 
-void test_heap(void)
+void test_huffman(void)
 {
-	struct heap *h;
-	struct hcnode a, b, c, d, e;
-	struct hcnode *nodes[3];
-	d.frequency = 4;
-	e.frequency = 5;
-	b.frequency = 2;
-	c.frequency = 3;
-	a.frequency = 1;
-	nodes[0] = &a; nodes[1] = &b; nodes[2] = &c;
-	nodes[3] = &d; nodes[4] = &e;
-	h = heap_build(nodes, 5);
+	struct hctree *tree;
+	u16 root;
+	/* This example is from CLRS */
+	u32 freqs[] = {5, 9, 12, 13, 16, 45};
+	int chars[] = {'f','e','c','b','d','a'};
+	int count = 6, i;
+
+	tree = huffman_new();
+	huffman_init(tree, freqs, chars, 6);
+	root = huffman(tree);
 
-	assert (1 == heap_extract_min(h)->frequency);
-	assert (2 == heap_extract_min(h)->frequency);
-	assert (3 == heap_extract_min(h)->frequency);
-	assert (4 == heap_extract_min(h)->frequency);
-	assert (5 == heap_extract_min(h)->frequency);
+	/* Leaves first, then the internal nodes */
+	assert(root == 2*count-2);
+	assert(tree->nodes[root].frequency == 100);
+	assert(tree->nodes[root].parent == HC_NIL);
+	for (i=0; i<count; i++) {
+		assert(tree->nodes[i].left == HC_NIL);
+		assert(tree->nodes[i].character == chars[i]);
+	}
+	for (i=count; i<root; i++)
+		assert(tree->nodes[i].parent > i);
 
-	heap_free(h);
+	/* The arena is reused for the next tree */
+	huffman_init(tree, freqs, chars, 2);
+	assert(huffman(tree) == 2);
+	assert(tree->nodes[2].frequency == 14);
+
+	huffman_free(tree);
 }
 
-void test_huffman(void)
+void test_huffman_code_table(void)
 {
-	struct hcnode *root, *n;
-	/* This example is from CLRS */
+	struct hctree *tree;
 	u32 freqs[] = {5, 9, 12, 13, 16, 45};
 	int chars[] = {'f','e','c','b','d','a'};
 	u32 expect_codes[] = {0xc, 0xd, 0x4, 0x5, 0x7, 0x0};
+	int expect_lens[] = {4, 4, 3, 3, 3, 1};
+	struct hccode table[256];
+	int i;
 
-	int count = 6, i;
-	struct hcnode **nodes;
+	tree = huffman_new();
+	huffman_init(tree, freqs, chars, 6);
+	huffman(tree);
+	huffman_code_table(tree, table);
 
-	nodes = huffman_init(freqs, chars, 6);
-	root = huffman(nodes, 6);
+	for (i=0; i<6; i++) {
+		assert(table[chars[i]].len == expect_lens[i]);
+		assert(table[chars[i]].bits == expect_codes[i]);
+	}
 
-	huffman_make_codes(root);
-	for (i=0; i<count; i++) {
-		n = nodes[i];
-/* 		printf("code for character %c (freq %d): %x (len %d) (expecting %x)\n", n->character, n->frequency, bits_to_integer(n->code, n->code_len), n->code_len, expect_codes[i]); */
-		assert(bits_to_integer(n->code, n->code_len) == expect_codes[i]);
+	huffman_free(tree);
+}
+
+void test_huffman_decoder(void)
+{
+	struct hctree *tree;
+	struct hccode codes[40];
+	struct hcdecoder *dec;
+	struct bitfile *bf;
+	u32 freqs[40];
+	int chars[40];
+	u8 *buf;
+	size_t len;
+	int i;
+
+	/* Fibonacci frequencies give codes up to 39 bits, going through
+	   several levels of subtables */
+	for (i=0; i<40; i++) {
+		freqs[i] = i < 2 ? 1 : freqs[i-1] + freqs[i-2];
+		chars[i] = i;
 	}
+	tree = huffman_new();
+	huffman_init(tree, freqs, chars, 40);
+	huffman(tree);
+	huffman_code_table(tree, codes);
+	huffman_free(tree);
+
+	bf = bitfile_to_memory(NULL, 0);
+	for (i=0; i<4000; i++)
+		bitfile_put_code(bf, codes[(i*17) % 40].bits,
+				 codes[(i*17) % 40].len);
+	buf = bitfile_close_memory(bf, &len);
+
+	dec = huffman_decoder(codes, 40);
+	bf = bitfile_from_memory(buf, len);
+	for (i=0; i<4000; i++)
+		assert(huffman_decode(dec, bf) == (i*17) % 40);
+	bitfile_close(bf);
+	huffman_decoder_free(dec);
+	xfree(buf);
+}
+
+#define MULTI_TEST_SYM(i) ((i) % 1000 == 999 ? 300 : 39 - ((i)*(i) % 41) % 40)
+
+void test_huffman_decoder_multi(void)
+{
+	u64 freqs[301] = {0,};
+	struct hccode codes[301];
+	struct hcdecoder *dec;
+	struct bitfile *bf;
+	u8 lens[301];
+	u8 syms[HC_MULTI_SYMS];
+	u8 *buf;
+	size_t len;
+	int i, j, n;
+
+	/* Short codes for the last of the first 40 symbols, long ones
+	   before them and a rare symbol that is not a byte */
+	for (i=0; i<40; i++)
+		freqs[i] = i < 2 ? 1 : freqs[i-1] + freqs[i-2];
+	freqs[300] = 1;
+	huffman_lengths(freqs, 301, lens);
+	huffman_limit_lengths(lens, 301, 20);
+	assert(huffman_canonical_codes(lens, 301, codes) == 0);
+
+	bf = bitfile_to_memory(NULL, 0);
+	for (i=0; i<5000; i++)
+		bitfile_put_code(bf, codes[MULTI_TEST_SYM(i)].bits,
+				 codes[MULTI_TEST_SYM(i)].len);
+	buf = bitfile_close_memory(bf, &len);
+
+	/* Only kept when it resolves enough symbols per lookup */
+	dec = huffman_decoder(codes, 301);
+	assert(huffman_decoder_multi(dec, HC_MULTI_SYMS + 1) > 1.5);
+	assert(dec->multi == NULL);
+	assert(huffman_decoder_multi(dec, 1.5) > 1.5);
+	assert(dec->multi != NULL);
+
+	bf = bitfile_from_memory(buf, len);
+	for (i=0; i<5000; ) {
+		n = huffman_decode_multi(dec, bf, syms);
+		if (n == 0) {
+			assert(huffman_decode(dec, bf) == MULTI_TEST_SYM(i));
+			i++;
+		}
+		for (j=0; j<n; j++, i++)
+			assert(syms[j] == MULTI_TEST_SYM(i));
+	}
+	bitfile_close(bf);
+	huffman_decoder_free(dec);
+	xfree(buf);
+}
+
+void test_huffman_canonical(void)
+{
+	/* Example from RFC 1951 */
+	u8 lens[] = {3, 3, 3, 3, 3, 2, 4, 4};
+	u32 expect_codes[] = {0x2, 0x3, 0x4, 0x5, 0x6, 0x0, 0xe, 0xf};
+	u8 bad_lens[] = {1, 1, 2};
+	struct hccode codes[8];
+	int i;
+
+	assert(huffman_canonical_codes(lens, 8, codes) == 0);
+	for (i=0; i<8; i++) {
+		assert(codes[i].len == lens[i]);
+		assert(codes[i].bits == expect_codes[i]);
+	}
+
+	assert(huffman_canonical_codes(bad_lens, 3, codes) != 0);
+}
+
+void test_huffman_limit(void)
+{
+	struct hctree *tree;
+	struct hccode codes[40];
+	u32 freqs[40];
+	int chars[40];
+	u8 lens[40];
+	int i, limit;
+
+	for (i=0; i<40; i++) {
+		freqs[i] = i < 2 ? 1 : freqs[i-1] + freqs[i-2];
+		chars[i] = i;
+	}
+	tree = huffman_new();
+	huffman_init(tree, freqs, chars, 40);
+	huffman(tree);
+	huffman_code_table(tree, codes);
+	huffman_free(tree);
+
+	for (limit=6; limit<=40; limit++) {
+		for (i=0; i<40; i++)
+			lens[i] = codes[i].len;
+		huffman_limit_lengths(lens, 40, limit);
+
+		for (i=0; i<40; i++) {
+			assert(lens[i] >= 1 && lens[i] <= limit);
+			/* More frequent symbols never get longer codes */
+			if (i > 0)
+				assert(lens[i] <= lens[i-1]);
+		}
+
+		/* Still a complete prefix code: the last code of the longest
+		   length is all ones */
+		assert(huffman_canonical_codes(lens, 40, codes) == 0);
+		for (i=39; lens[i] != lens[0]; i--)
+			;
+		assert(codes[i].bits == ((u64)1 << lens[i]) - 1);
+	}
+}
+
+void test_huffman_lengths(void)
+{
+	u64 freqs[300] = {5, 0, 9, 12, 13, 16, 45};
+	u8 expect[7] = {4, 0, 4, 3, 3, 3, 1};
+	u8 lens[300];
+	struct hctree *tree;
+	struct hccode codes[300];
+	u32 freqs32[300];
+	int chars[300];
+	u64 cost, legacy_cost;
+	int i;
+
+	huffman_lengths(freqs, 7, lens);
+	for (i=0; i<7; i++)
+		assert(lens[i] == expect[i]);
+
+	/* A single symbol still gets a one bit code */
+	huffman_lengths(freqs, 1, lens);
+	assert(lens[0] == 1);
+
+	/* Same cost as the tree built by huffman() */
+	for (i=0; i<300; i++) {
+		freqs[i] = freqs32[i] = 1 + (i * 7919) % 1000;
+		chars[i] = i;
+	}
+	huffman_lengths(freqs, 300, lens);
+	tree = huffman_new();
+	huffman_init(tree, freqs32, chars, 300);
+	huffman(tree);
+	huffman_code_table(tree, codes);
+	huffman_free(tree);
+
+	cost = legacy_cost = 0;
+	for (i=0; i<300; i++) {
+		cost += freqs[i] * lens[i];
+		legacy_cost += freqs[i] * codes[i].len;
+	}
+	assert(cost <= legacy_cost);
+	assert(huffman_canonical_codes(lens, 300, codes) == 0);
+}
+
+void test_huffman_count(void)
+{
+	u8 data[1000];
+	u64 freqs[256], expect[256];
+	size_t len;
+	int i;
 
+	for (i=0; i<sizeof(data); i++)
+		data[i] = i < 500 ? 'x' : (u8)(i * 31 + i / 7);
+
+	/* Lengths that leave 0-7 bytes after the unrolled loop */
+	for (len=0; len<=sizeof(data); len+=123) {
+		memset(expect, 0, sizeof(expect));
+		for (i=0; i<len; i++)
+			expect[data[i]]++;
+
+		/* Counts add to what is there */
+		memset(freqs, 0, sizeof(freqs));
+		freqs['x'] = 10;
+		huffman_count(data, len, freqs);
+		freqs['x'] -= 10;
+		assert(!memcmp(freqs, expect, sizeof(freqs)));
+	}
 }
 
 void test_huffman2(void)
 {
-	struct hcnode *root, *n;
-	unsigned int freqs[256];
+	struct hctree *tree;
+	struct hccode table[256];
+	u32 freqs[256];
 	int chars[256];
 	int count = 256, i;
-	struct hcnode **nodes;
 
 	for(i=0; i<count; i++) {
 		freqs[i] = i;
 		chars[i] = i;
 	}
 
-	nodes = huffman_init(freqs, chars, 256);
-	root = huffman(nodes, 256);
+	tree = huffman_new();
+	huffman_init(tree, freqs, chars, 256);
+	huffman(tree);
+	huffman_code_table(tree, table);
+	huffman_free(tree);
 
-	huffman_make_codes(root);
 	for (i=0; i<count; i++) {
-		n = nodes[i];
-		printf("code for character %d: 0x%x\n", n->character, bits_to_integer(n->code, n->code_len));
+		printf("code for character %d: 0x%x\n", i, (unsigned)table[i].bits);
 	}
 }
 
+void test_adaptive(void)
+{
+	struct hcadaptive *enc, *dec;
+	struct hcpak_options opts;
+	struct hcpak_stats stats;
+	struct bitfile *in, *out;
+	u8 data[20000], *buf, *unpacked;
+	size_t len, unpacked_len;
+	u64 bits = 0, dbits = 0;
+	int i;
+
+	/* Every byte at least once, mostly a few */
+	for (i=0; i<sizeof(data); i++)
+		data[i] = i < 256 ? i : "eeeeeeeetaaoinshrdlu"[(i*i) % 20];
+
+	enc = adaptive_new();
+	out = bitfile_to_memory(NULL, 0);
+	for (i=0; i<sizeof(data); i++)
+		bits += adaptive_encode(enc, out, data[i]);
+	bits += adaptive_encode(enc, out, HCA_SYMBOLS-1);
+	buf = bitfile_close_memory(out, &len);
+	adaptive_free(enc);
+	assert(len == (bits + 7) / 8);
+	assert(len < sizeof(data) / 2);
+
+	dec = adaptive_new();
+	in = bitfile_from_memory(buf, len);
+	for (i=0; i<sizeof(data); i++)
+		assert(adaptive_decode(dec, in, &dbits) == data[i]);
+	assert(adaptive_decode(dec, in, &dbits) == HCA_SYMBOLS-1);
+	assert(dbits == bits);
+	bitfile_close(in);
+	adaptive_free(dec);
+	xfree(buf);
+
+	/* Through hcpak */
+	hcpak_default_options(&opts);
+	opts.adaptive = 1;
+	in = bitfile_from_memory(data, sizeof(data));
+	out = bitfile_to_memory(NULL, 0);
+	hcpak_compress(in, out, &opts, &stats);
+	bitfile_close(in);
+	buf = bitfile_close_memory(out, &len);
+	assert(buf[5] == 0x02);
+
+	in = bitfile_from_memory(buf, len);
+	out = bitfile_to_memory(NULL, 0);
+	hcpak_decompress(in, out, NULL, &stats);
+	bitfile_close(in);
+	unpacked = bitfile_close_memory(out, &unpacked_len);
+
+	assert(unpacked_len == sizeof(data));
+	assert(!memcmp(unpacked, data, sizeof(data)));
+	xfree(buf);
+	xfree(unpacked);
+}
+
 void test_bitfile(void)
 {
 	struct bitfile *bf;
@@ -197,6 +478,800 @@ void test_bitfile(void)
 
 }
 
+void test_bitfile_rewind(void)
+{
+	struct bitfile *bf;
+	u8 res;
+	int i, len = 3*4096 + 123;
+
+	/* Write more than fits into the read window */
+	bf = bitfile_open("/tmp/bf-rewind", "w");
+	for (i=0; i<len; i++)
+		bitfile_put_byte(bf, (u8)(i*7));
+	bitfile_close(bf);
+
+	bf = bitfile_open("/tmp/bf-rewind", "r");
+	for (i=0; i<len; i++) {
+		assert(bitfile_get_byte(bf, &res) == 0);
+		assert(res == (u8)(i*7));
+	}
+	assert(bitfile_get_byte(bf, &res) != 0);
+
+	/* Start of the file has been dropped, this has to seek */
+	bitfile_rewind(bf);
+
+	for (i=0; i<len; i++) {
+		assert(bitfile_get_byte(bf, &res) == 0);
+		assert(res == (u8)(i*7));
+	}
+	assert(bitfile_get_byte(bf, &res) != 0);
+
+	bitfile_close(bf);
+	unlink("/tmp/bf-rewind");
+}
+
+void test_bitfile_seek(void)
+{
+	struct bitfile *bf;
+	u64 size;
+	u8 res;
+	int i, len = 3*4096 + 123;
+	static const int offsets[] = { 5000, 10, 4096, 10000, 0 };
+
+	bf = bitfile_open("/tmp/bf-seek", "w");
+	for (i=0; i<len; i++)
+		bitfile_put_byte(bf, (u8)(i*7));
+	bitfile_close(bf);
+
+	/* Back and forth, in and out of the read window */
+	bf = bitfile_open("/tmp/bf-seek", "r");
+	assert(bitfile_size(bf, &size) == 0 && size == len);
+	for (i=0; i<sizeof(offsets)/sizeof(offsets[0]); i++) {
+		bitfile_seek(bf, offsets[i]);
+		assert(bitfile_get_byte(bf, &res) == 0);
+		assert(res == (u8)(offsets[i]*7));
+	}
+	bitfile_seek(bf, len);
+	assert(bitfile_get_byte(bf, &res) != 0);
+	bitfile_close(bf);
+
+	bf = bitfile_open_mmap("/tmp/bf-seek");
+	bitfile_seek(bf, 9999);
+	assert(bitfile_get_byte(bf, &res) == 0 && res == (u8)(9999*7));
+	bitfile_close(bf);
+	unlink("/tmp/bf-seek");
+}
+
+void test_bitfile_mmap(void)
+{
+	struct bitfile *bf;
+	u8 res;
+	u32 res32;
+	int i;
+
+	bf = bitfile_open("/tmp/bf-mmap", "w");
+	for (i=0; i<10000; i++)
+		bitfile_put_u32(bf, i);
+	bitfile_put_bit(bf, 1);
+	bitfile_close(bf);
+
+	bf = bitfile_open_mmap("/tmp/bf-mmap");
+	for (i=0; i<10000; i++) {
+		assert(bitfile_get_u32(bf, &res32) == 0);
+		assert(res32 == i);
+	}
+	assert(bitfile_get_bit(bf, &res) == 0 && res == 1);
+
+	bitfile_rewind(bf);
+	assert(bitfile_get_u32(bf, &res32) == 0 && res32 == 0);
+	bitfile_close(bf);
+	unlink("/tmp/bf-mmap");
+}
+
+void test_bitfile_async(void)
+{
+	struct bitfile *bf;
+	u8 res;
+	u32 res32;
+	int i, pass;
+
+	/* Small chunks so that words and bytes straddle chunk borders */
+	bf = bitfile_open_async("/tmp/bf-async", "w", 13);
+	for (i=0; i<10000; i++) {
+		bitfile_put_u32(bf, i);
+		bitfile_put_code(bf, i & 0x1f, 5);
+		bitfile_put_bit(bf, i & 1);
+	}
+	bitfile_close(bf);
+
+	bf = bitfile_open_async("/tmp/bf-async", "r", 13);
+	for (pass=0; pass<2; pass++) {
+		for (i=0; i<10000; i++) {
+			assert(bitfile_get_u32(bf, &res32) == 0 && res32 == i);
+			assert(bitfile_refill_bits(bf) >= 6);
+			assert(bitfile_peek_bits(bf, 5) == (i & 0x1f));
+			bitfile_consume_bits(bf, 5);
+			assert(bitfile_get_bit(bf, &res) == 0 && res == (i & 1));
+		}
+		assert(bitfile_get_byte(bf, &res) != 0);
+		bitfile_rewind(bf);
+	}
+	bitfile_close(bf);
+	unlink("/tmp/bf-async");
+}
+
+void test_bitfile_code(void)
+{
+	struct bitfile *bf;
+	u64 code;
+	u8 res;
+	int i, j, len;
+
+	/* Mix codes of all lengths with single bits and bytes, going over
+	   several buffer boundaries */
+	bf = bitfile_open("/tmp/bf-code", "w");
+	for (i=0; i<2000; i++) {
+		len = i % 65;
+		code = ((u64)i * 0x9e3779b9UL) << 20 | (u64)i;
+		if (len < 64) code &= ((u64)1 << len) - 1;
+		bitfile_put_code(bf, code, len);
+		if (i % 7 == 0) bitfile_put_bit(bf, i & 1);
+		if (i % 11 == 0) bitfile_put_byte(bf, (u8)i);
+	}
+	bitfile_close(bf);
+
+	bf = bitfile_open("/tmp/bf-code", "r");
+	for (i=0; i<2000; i++) {
+		len = i % 65;
+		code = ((u64)i * 0x9e3779b9UL) << 20 | (u64)i;
+		for (j=len-1; j>=0; j--) {
+			assert(bitfile_get_bit(bf, &res) == 0);
+			assert(res == ((code >> j) & 1));
+		}
+		if (i % 7 == 0) {
+			assert(bitfile_get_bit(bf, &res) == 0);
+			assert(res == (i & 1));
+		}
+		if (i % 11 == 0) {
+			assert(bitfile_get_byte(bf, &res) == 0);
+			assert(res == (u8)i);
+		}
+	}
+	bitfile_close(bf);
+	unlink("/tmp/bf-code");
+}
+
+void test_bitfile_peek(void)
+{
+	struct bitfile *bf;
+	int i, len, total = 0;
+
+	bf = bitfile_open("/tmp/bf-peek", "w");
+	for (i=0; i<5000; i++) {
+		len = 1 + i % 56;
+		bitfile_put_code(bf, (u64)i & (((u64)1 << len) - 1), len);
+		total += len;
+	}
+	bitfile_close(bf);
+
+	bf = bitfile_open("/tmp/bf-peek", "r");
+	for (i=0; i<5000; i++) {
+		len = 1 + i % 56;
+		assert(bitfile_refill_bits(bf) >= len);
+		assert(bitfile_peek_bits(bf, len) ==
+		       ((u64)i & (((u64)1 << len) - 1)));
+		bitfile_consume_bits(bf, len);
+	}
+
+	/* Only the zero padding of the last byte is left */
+	assert(bitfile_refill_bits(bf) == (8 - total % 8) % 8);
+	assert(bitfile_peek_bits(bf, 56) == 0);
+
+	bitfile_close(bf);
+	unlink("/tmp/bf-peek");
+}
+
+void test_bitfile_memory(void)
+{
+	struct bitfile *bf;
+	u8 buf[16], *out;
+	size_t len;
+	u8 res;
+	int i;
+
+	/* Growing output */
+	bf = bitfile_to_memory(NULL, 0);
+	for (i=0; i<10000; i++)
+		bitfile_put_u32(bf, i);
+	bitfile_put_bit(bf, 1);
+	out = bitfile_close_memory(bf, &len);
+	assert(out != NULL && len == 40001);
+
+	bf = bitfile_from_memory(out, len);
+	for (i=0; i<10000; i++) {
+		u32 res32;
+		assert(bitfile_get_u32(bf, &res32) == 0 && res32 == i);
+	}
+	assert(bitfile_get_bit(bf, &res) == 0 && res == 1);
+	assert(bitfile_get_bit(bf, &res) == 0 && res == 0);
+	bitfile_rewind(bf);
+	assert(bitfile_get_byte(bf, &res) == 0 && res == 0);
+	bitfile_close(bf);
+	xfree(out);
+
+	/* Growing output whose last codes are still in the accumulator
+	   when closing, and cross the end of the first buffer */
+	bf = bitfile_to_memory(NULL, 4096);
+	for (i=0; i<4093; i++)
+		bitfile_put_byte(bf, (u8)i);
+	bitfile_put_code(bf, (u64)0x12345678 << 8 | 0x9a, 40);
+	out = bitfile_close_memory(bf, &len);
+	assert(out != NULL && len == 4098);
+	for (i=0; i<4093; i++)
+		assert(out[i] == (u8)i);
+	assert(out[4093] == 0x12 && out[4097] == 0x9a);
+	xfree(out);
+
+	/* Fixed-size output, exactly full */
+	bf = bitfile_to_memory(buf, 4);
+	bitfile_put_u32(bf, 0x01020304);
+	assert(bitfile_close_memory(bf, &len) == buf && len == 4);
+	assert(buf[0] == 1 && buf[3] == 4);
+
+	/* Fixed-size output, overflowing */
+	bf = bitfile_to_memory(buf, sizeof(buf));
+	for (i=0; i<5000; i++)
+		bitfile_put_code(bf, 0x7, 3);
+	assert(bitfile_close_memory(bf, &len) == NULL && len == 1875);
+}
+
+void test_bitfile_align(void)
+{
+	struct bitfile *bf;
+	u8 data[10000], back[10000], *buf;
+	size_t len;
+	u32 v;
+	int i;
+
+	for (i=0; i<sizeof(data); i++)
+		data[i] = i * 31;
+
+	bf = bitfile_to_memory(NULL, 0);
+	bitfile_put_code(bf, 5, 3);
+	bitfile_align(bf);
+	bitfile_put_bytes(bf, data, sizeof(data));
+	bitfile_put_u32(bf, 0xdeadbeef);
+	bitfile_put_code(bf, 1, 1);
+	bitfile_put_bytes(bf, data, 3);
+	buf = bitfile_close_memory(bf, &len);
+	assert(len == 1 + sizeof(data) + 4 + 4);
+
+	bf = bitfile_from_memory(buf, len);
+	bitfile_refill_bits(bf);
+	assert(bitfile_peek_bits(bf, 3) == 5);
+	bitfile_consume_bits(bf, 3);
+	bitfile_align(bf);
+
+	/* Partly from the bits read ahead, the rest copied from memory */
+	assert(bitfile_get_bytes(bf, back, 2) == 0);
+	assert(bitfile_get_bytes(bf, back + 2, sizeof(data) - 2) == 0);
+	assert(!memcmp(back, data, sizeof(data)));
+	assert(bitfile_get_u32(bf, &v) == 0 && v == 0xdeadbeef);
+
+	/* Unaligned */
+	assert(bitfile_get_bit(bf, back) == 0 && back[0] == 1);
+	assert(bitfile_get_bytes(bf, back, 3) == 0);
+	assert(!memcmp(back, data, 3));
+	assert(bitfile_get_bytes(bf, back, 1) != 0);
+
+	bitfile_close(bf);
+	xfree(buf);
+}
+
+void test_hcpak_memory(void)
+{
+	struct bitfile *in, *out;
+	struct hcpak_stats stats;
+	u8 data[50000], *packed, *unpacked;
+	size_t packed_len, unpacked_len;
+	int i;
+
+	for (i=0; i<sizeof(data); i++)
+		data[i] = "aaaaaaaabbbbccd"[(i * 7 + i / 13) % 15] + (i % 1000 == 0);
+
+	in = bitfile_from_memory(data, sizeof(data));
+	out = bitfile_to_memory(NULL, 0);
+	hcpak_compress(in, out, NULL, &stats);
+	bitfile_close(in);
+	packed = bitfile_close_memory(out, &packed_len);
+	assert(packed_len < sizeof(data) / 3);
+
+	in = bitfile_from_memory(packed, packed_len);
+	out = bitfile_to_memory(NULL, 0);
+	hcpak_decompress(in, out, NULL, &stats);
+	bitfile_close(in);
+	unpacked = bitfile_close_memory(out, &unpacked_len);
+
+	assert(unpacked_len == sizeof(data));
+	assert(!memcmp(unpacked, data, sizeof(data)));
+
+	xfree(packed);
+	xfree(unpacked);
+}
+
+void test_hcpak_streams(void)
+{
+	struct hcpak_options opts;
+	struct bitfile *in, *out;
+	struct hcpak_stats stats;
+	size_t data_len = 600001, packed_len, unpacked_len;
+	u8 *data, *packed, *unpacked;
+	int i, streams;
+
+	data = xmalloc(data_len);
+	for (i=0; i<data_len; i++)
+		data[i] = "aaaaaaaabbbbccd"[(i * 7 + i / 13) % 15] + (i % 1000 == 0);
+
+	hcpak_default_options(&opts);
+	for (streams=1; streams<=HCPAK_MAX_STREAMS; streams++) {
+		opts.streams = streams;
+		opts.block_len = 0;
+		in = bitfile_from_memory(data, data_len);
+		out = bitfile_to_memory(NULL, 0);
+		hcpak_compress(in, out, &opts, &stats);
+		bitfile_close(in);
+		packed = bitfile_close_memory(out, &packed_len);
+		assert(packed[5] == (streams > 1));
+
+		in = bitfile_from_memory(packed, packed_len);
+		out = bitfile_to_memory(NULL, 0);
+		hcpak_decompress(in, out, NULL, &stats);
+		bitfile_close(in);
+		unpacked = bitfile_close_memory(out, &unpacked_len);
+
+		assert(unpacked_len == data_len);
+		assert(!memcmp(unpacked, data, data_len));
+
+		xfree(packed);
+		xfree(unpacked);
+	}
+	xfree(data);
+}
+
+/* Fill 'len' bytes at 'data' with characters of 'alphabet' picked by a
+   small LCG, the same sequence every time */
+static void fill_text(u8 *data, size_t len, const char *alphabet)
+{
+	size_t i, n = strlen(alphabet);
+	u32 x = 1;
+
+	for (i=0; i<len; i++) {
+		x = x * 1103515245 + 12345;
+		data[i] = alphabet[(x >> 16) % n];
+	}
+}
+
+/* Compress 'len' bytes at 'data' with 'opts' and check they come back.
+   Returns the compressed length. */
+static size_t hcpak_roundtrip(const u8 *data, size_t len,
+			      const struct hcpak_options *opts, u8 version)
+{
+	struct bitfile *in, *out;
+	struct hcpak_stats stats;
+	u8 *packed, *unpacked;
+	size_t packed_len, unpacked_len;
+
+	in = bitfile_from_memory(data, len);
+	out = bitfile_to_memory(NULL, 0);
+	hcpak_compress(in, out, opts, &stats);
+	bitfile_close(in);
+	packed = bitfile_close_memory(out, &packed_len);
+	assert(packed[4] == version);
+
+	in = bitfile_from_memory(packed, packed_len);
+	out = bitfile_to_memory(NULL, 0);
+	hcpak_decompress(in, out, opts, &stats);
+	bitfile_close(in);
+	unpacked = bitfile_close_memory(out, &unpacked_len);
+
+	assert(unpacked_len == len);
+	assert(!memcmp(unpacked, data, len));
+
+	xfree(packed);
+	xfree(unpacked);
+	return packed_len;
+}
+
+void test_hcpak_blocks(void)
+{
+	struct hcpak_options opts;
+	size_t data_len = 300001, blocks_len, single_len;
+	u8 *data;
+
+	/* Statistics change halfway through */
+	data = xmalloc(data_len);
+	fill_text(data, data_len / 2, "abcd");
+	fill_text(data + data_len / 2, data_len - data_len / 2, "wxyz");
+
+	hcpak_default_options(&opts);
+	opts.block_len = HCPAK_MIN_BLOCK_LEN;
+	blocks_len = hcpak_roundtrip(data, data_len, &opts, '3');
+
+	opts.block_len = 0;
+	single_len = hcpak_roundtrip(data, data_len, &opts, '2');
+	assert(blocks_len < single_len * 3 / 4);
+
+	/* Exactly a block, a block and one byte, and nothing at all */
+	opts.block_len = HCPAK_MIN_BLOCK_LEN;
+	hcpak_roundtrip(data, HCPAK_MIN_BLOCK_LEN, &opts, '3');
+	hcpak_roundtrip(data, HCPAK_MIN_BLOCK_LEN + 1, &opts, '3');
+	hcpak_roundtrip(data, 0, &opts, '3');
+
+	xfree(data);
+}
+
+/* Compress 'len' bytes at 'data' with 'opts' into a new buffer */
+static u8 * hcpak_pack(const u8 *data, size_t len,
+		       const struct hcpak_options *opts, size_t *packed_len)
+{
+	struct bitfile *in, *out;
+	struct hcpak_stats stats;
+
+	in = bitfile_from_memory(data, len);
+	out = bitfile_to_memory(NULL, 0);
+	hcpak_compress(in, out, opts, &stats);
+	bitfile_close(in);
+	return bitfile_close_memory(out, packed_len);
+}
+
+void test_hcpak_threads(void)
+{
+	struct hcpak_options opts;
+	size_t data_len = 40 * HCPAK_MIN_BLOCK_LEN + 7, len1, len3;
+	u8 *data, *packed1, *packed3;
+
+	data = xmalloc(data_len);
+	fill_text(data, data_len, "abcdefgh");
+
+	/* More blocks than jobs, coded the same as by one thread */
+	hcpak_default_options(&opts);
+	opts.block_len = HCPAK_MIN_BLOCK_LEN;
+	packed1 = hcpak_pack(data, data_len, &opts, &len1);
+	opts.threads = 3;
+	packed3 = hcpak_pack(data, data_len, &opts, &len3);
+	assert(len1 == len3 && !memcmp(packed1, packed3, len1));
+
+	/* Decoded by three threads too */
+	hcpak_roundtrip(data, data_len, &opts, '3');
+	hcpak_roundtrip(data, HCPAK_MIN_BLOCK_LEN, &opts, '3');
+	hcpak_roundtrip(data, 0, &opts, '3');
+
+	/* A single code from frequencies counted by three threads */
+	xfree(packed1);
+	xfree(packed3);
+	opts.block_len = 0;
+	opts.threads = 1;
+	packed1 = hcpak_pack(data, data_len, &opts, &len1);
+	opts.threads = 3;
+	packed3 = hcpak_pack(data, data_len, &opts, &len3);
+	assert(len1 == len3 && !memcmp(packed1, packed3, len1));
+	hcpak_roundtrip(data, data_len, &opts, '2');
+
+	xfree(packed1);
+	xfree(packed3);
+	xfree(data);
+}
+
+void test_hcpak_sample(void)
+{
+	struct hcpak_options opts;
+	size_t data_len = 2 * 1024 * 1024 + 5, exact_len, sampled_len;
+	u8 *data;
+
+	data = xmalloc(data_len);
+	fill_text(data, data_len, "aaaabbcdefgh");
+
+	/* Bytes the windows in the middle of each share cannot see */
+	data[0] = 0;
+	data[data_len - 1] = 255;
+	data[data_len / 2 + 70000] = 'z';
+
+	hcpak_default_options(&opts);
+	opts.block_len = 0;
+	exact_len = hcpak_roundtrip(data, data_len, &opts, '2');
+	opts.sample = 1;
+	sampled_len = hcpak_roundtrip(data, data_len, &opts, '2');
+	assert(sampled_len < exact_len + exact_len / 100);
+
+	opts.block_len = HCPAK_MIN_BLOCK_LEN * 4;
+	hcpak_roundtrip(data, data_len, &opts, '3');
+
+	xfree(data);
+}
+
+void test_hcpak_stored(void)
+{
+	struct hcpak_options opts;
+	size_t data_len = 3 * HCPAK_MIN_BLOCK_LEN, len;
+	u8 *data, *packed;
+	u32 x = 1;
+	int i;
+
+	/* Random bytes, then text */
+	data = xmalloc(data_len);
+	for (i=0; i<data_len; i++) {
+		x = x * 1103515245 + 12345;
+		data[i] = i < 2 * HCPAK_MIN_BLOCK_LEN ? x >> 24 : "abcd"[x >> 30];
+	}
+
+	/* A single code is not worth it for the whole */
+	hcpak_default_options(&opts);
+	opts.block_len = 0;
+	packed = hcpak_pack(data, 2 * HCPAK_MIN_BLOCK_LEN, &opts, &len);
+	assert(packed[5] == 0x08 && len == 6 + 2*HCPAK_MIN_BLOCK_LEN);
+	xfree(packed);
+	hcpak_roundtrip(data, 2 * HCPAK_MIN_BLOCK_LEN, &opts, '2');
+
+	/* Blocks of random bytes are stored, the last one is coded */
+	opts.block_len = HCPAK_MIN_BLOCK_LEN;
+	len = hcpak_roundtrip(data, data_len, &opts, '3');
+	assert(len < 2 * HCPAK_MIN_BLOCK_LEN + HCPAK_MIN_BLOCK_LEN / 3);
+	assert(len > 2 * HCPAK_MIN_BLOCK_LEN);
+
+	xfree(data);
+}
+
+void test_hcpak_dict(void)
+{
+	const char *corpus = "GET /index.html 200\nGET /about.html 200\n"
+		"POST /login 302\nGET /index.html 304\nGET /favicon.ico 404\n";
+	const char *record = "GET /login 200\n";
+	struct hcpak_options opts;
+	struct hcpak_dict *dict, *loaded;
+	struct bitfile *bf;
+	u8 *table, binary[256];
+	size_t table_len, len;
+	int i;
+
+	bf = bitfile_from_memory((u8 *)corpus, strlen(corpus));
+	dict = hcpak_dict_train(bf, NULL);
+	bitfile_close(bf);
+
+	/* Saved and loaded back the same */
+	bf = bitfile_to_memory(NULL, 0);
+	hcpak_dict_save(dict, bf);
+	table = bitfile_close_memory(bf, &table_len);
+	bf = bitfile_from_memory(table, table_len);
+	loaded = hcpak_dict_load(bf);
+	bitfile_close(bf);
+	assert(hcpak_dict_id(loaded) == hcpak_dict_id(dict));
+
+	/* Only the header and the ID go with the record */
+	hcpak_default_options(&opts);
+	opts.dict = dict;
+	len = hcpak_roundtrip((u8 *)record, strlen(record), &opts, '2');
+	assert(len < 6 + 4 + strlen(record));
+
+	/* Bytes not in the corpus and empty input still code */
+	for (i=0; i<sizeof(binary); i++)
+		binary[i] = i;
+	opts.dict = loaded;
+	hcpak_roundtrip(binary, sizeof(binary), &opts, '2');
+	hcpak_roundtrip(binary, 0, &opts, '2');
+
+	hcpak_dict_free(dict);
+	hcpak_dict_free(loaded);
+	xfree(table);
+}
+
+void test_hcpak_msg(void)
+{
+	const char *corpus = "GET /index.html 200\nGET /about.html 200\n"
+		"POST /login 302\nGET /index.html 304\nGET /favicon.ico 404\n";
+	struct hcpak_dict *dict;
+	struct bitfile *bf;
+	u8 msg[300], packed[HCPAK_MSG_BOUND(300)], unpacked[300];
+	size_t len, packed_len;
+	int i;
+
+	bf = bitfile_from_memory((u8 *)corpus, strlen(corpus));
+	dict = hcpak_dict_train(bf, NULL);
+	bitfile_close(bf);
+
+	for (i=0; i<sizeof(msg); i++)
+		msg[i] = i < 200 ? corpus[(i * 7) % strlen(corpus)] : i;
+
+	for (len=1; len<=sizeof(msg); len+=37) {
+		packed_len = hcpak_msg_compress(dict, msg, len, packed,
+						sizeof(packed));
+		assert(packed_len > 0);
+		if (len > 1 && len <= 200)
+			assert(packed_len < len);
+		assert(!hcpak_msg_decompress(dict, packed, packed_len,
+					     unpacked, len));
+		assert(!memcmp(unpacked, msg, len));
+
+		/* Too little room, and input cut short */
+		assert(!hcpak_msg_compress(dict, msg, len, packed,
+					   packed_len - 1));
+		if (packed_len > 4)
+			assert(hcpak_msg_decompress(dict, packed, packed_len/2,
+						    unpacked, len));
+	}
+
+	assert(hcpak_msg_compress(dict, msg, 0, packed, sizeof(packed)) == 0);
+	assert(!hcpak_msg_decompress(dict, packed, 0, unpacked, 0));
+	hcpak_dict_free(dict);
+
+	/* Every byte alike: long codes, decoded without the multi-symbol
+	   table */
+	for (i=0; i<sizeof(msg); i++)
+		msg[i] = i;
+	bf = bitfile_from_memory(msg, 256);
+	dict = hcpak_dict_train(bf, NULL);
+	bitfile_close(bf);
+
+	packed_len = hcpak_msg_compress(dict, msg, sizeof(msg), packed,
+					sizeof(packed));
+	assert(packed_len > 0);
+	assert(!hcpak_msg_decompress(dict, packed, packed_len, unpacked,
+				     sizeof(msg)));
+	assert(!memcmp(unpacked, msg, sizeof(msg)));
+
+	hcpak_dict_free(dict);
+}
+
+void test_hcpak_context(void)
+{
+	static const char *words[] = { "the ", "quick ", "brown ", "fox ",
+				       "jumps ", "over ", "lazy ", "dog\n" };
+	struct hcpak_options opts;
+	size_t data_len = 3 * HCPAK_MIN_BLOCK_LEN + 11, len, plain_len;
+	u8 *data;
+	u32 x = 1;
+	int i;
+
+	/* Words in random order: each letter says a lot about the next */
+	data = xmalloc(data_len);
+	for (i=0; i<data_len; ) {
+		const char *w;
+
+		x = x * 1103515245 + 12345;
+		for (w=words[x >> 29]; *w && i<data_len; w++)
+			data[i++] = *w;
+	}
+
+	hcpak_default_options(&opts);
+	opts.block_len = HCPAK_MIN_BLOCK_LEN;
+	plain_len = hcpak_roundtrip(data, data_len, &opts, '3');
+	opts.context = 1;
+	len = hcpak_roundtrip(data, data_len, &opts, '3');
+	assert(len < plain_len * 2 / 3);
+
+	/* Blocks not worth it are coded as before */
+	for (i=0; i<HCPAK_MIN_BLOCK_LEN; i++) {
+		x = x * 1103515245 + 12345;
+		data[i] = "abcdefgh"[x >> 29];
+	}
+	hcpak_roundtrip(data, data_len, &opts, '3');
+
+	opts.threads = 3;
+	hcpak_roundtrip(data, data_len, &opts, '3');
+
+	xfree(data);
+}
+
+/* Check hcpak_decompress_range() on 'packed' against 'data' */
+static void hcpak_check_range(const u8 *packed, size_t packed_len,
+			      const u8 *data, size_t data_len,
+			      u64 start, u64 len)
+{
+	struct bitfile *in, *out;
+	struct hcpak_stats stats;
+	u8 *unpacked;
+	size_t unpacked_len;
+
+	in = bitfile_from_memory(packed, packed_len);
+	out = bitfile_to_memory(NULL, 0);
+	hcpak_decompress_range(in, out, start, len, &stats);
+	bitfile_close(in);
+	unpacked = bitfile_close_memory(out, &unpacked_len);
+
+	if (start > data_len)
+		start = data_len;
+	if (len > data_len - start)
+		len = data_len - start;
+	assert(unpacked_len == len);
+	assert(!memcmp(unpacked, data + start, len));
+	xfree(unpacked);
+}
+
+void test_hcpak_range(void)
+{
+	struct hcpak_options opts;
+	size_t data_len = 5 * HCPAK_MIN_BLOCK_LEN + 99, len, indexed_len;
+	u8 *data, *packed, *indexed;
+	int i;
+	u64 b = HCPAK_MIN_BLOCK_LEN;
+
+	data = xmalloc(data_len);
+	fill_text(data, data_len, "abcdefgh");
+
+	hcpak_default_options(&opts);
+	opts.block_len = HCPAK_MIN_BLOCK_LEN;
+	packed = hcpak_pack(data, data_len, &opts, &len);
+	opts.index = 1;
+	indexed = hcpak_pack(data, data_len, &opts, &indexed_len);
+	assert(indexed_len == len + 4 + 6*8);
+
+	/* The index goes after the data, which still decodes */
+	hcpak_roundtrip(data, data_len, &opts, '3');
+
+	for (i=0; i<2; i++) {
+		const u8 *p = i ? indexed : packed;
+		size_t p_len = i ? indexed_len : len;
+
+		hcpak_check_range(p, p_len, data, data_len, 0, 10);
+		hcpak_check_range(p, p_len, data, data_len, b - 1, 2);
+		hcpak_check_range(p, p_len, data, data_len, 2*b, b);
+		hcpak_check_range(p, p_len, data, data_len, b + 7, 3*b);
+		hcpak_check_range(p, p_len, data, data_len, 5*b + 90, 100);
+		hcpak_check_range(p, p_len, data, data_len, 5*b + 99, 1);
+		hcpak_check_range(p, p_len, data, data_len, 9*b, 1);
+		hcpak_check_range(p, p_len, data, data_len, 0, data_len);
+	}
+
+	/* Workers write the same index */
+	opts.threads = 3;
+	xfree(packed);
+	packed = hcpak_pack(data, data_len, &opts, &len);
+	assert(len == indexed_len && !memcmp(packed, indexed, len));
+
+	xfree(packed);
+	xfree(indexed);
+	xfree(data);
+}
+
+void test_hcpak_version1(void)
+{
+	/* "abracadabra, abracadabra!\n" compressed by the original hcpak */
+	static const u8 packed[] = {
+		0x48, 0x43, 0x50, 0x41, 0x4b, 0x08, 0x0a, 0x00, 0x00, 0x00,
+		0x01, 0x20, 0x00, 0x00, 0x00, 0x01, 0x21, 0x00, 0x00, 0x00,
+		0x01, 0x2c, 0x00, 0x00, 0x00, 0x01, 0x61, 0x00, 0x00, 0x00,
+		0x0a, 0x62, 0x00, 0x00, 0x00, 0x04, 0x63, 0x00, 0x00, 0x00,
+		0x02, 0x64, 0x00, 0x00, 0x00, 0x02, 0x72, 0x00, 0x00, 0x00,
+		0x04, 0x68, 0xe5, 0xb4, 0x7d, 0x56, 0x8e, 0x5b, 0x47, 0xa9,
+		0xf8
+	};
+	const char *text = "abracadabra, abracadabra!\n";
+	struct hcpak_options opts;
+	struct bitfile *in, *out;
+	struct hcpak_stats stats;
+	u8 *unpacked;
+	size_t len;
+
+	in = bitfile_from_memory(packed, sizeof(packed));
+	out = bitfile_to_memory(NULL, 0);
+	hcpak_decompress(in, out, NULL, &stats);
+	bitfile_close(in);
+	unpacked = bitfile_close_memory(out, &len);
+
+	assert(len == strlen(text) && !memcmp(unpacked, text, len));
+	xfree(unpacked);
+
+	/* The same compressed with code lengths only */
+	hcpak_default_options(&opts);
+	opts.block_len = 0;
+	in = bitfile_from_memory((u8 *)text, strlen(text));
+	out = bitfile_to_memory(NULL, 0);
+	hcpak_compress(in, out, &opts, &stats);
+	bitfile_close(in);
+	unpacked = bitfile_close_memory(out, &len);
+	assert(len < sizeof(packed) / 2);
+	xfree(unpacked);
+}
+
 void test_bitfile2(void)
 {
 	struct bitfile *bf = bitfile_open("/dev/urandom", "r");
@@ -333,7 +1408,34 @@ int main(void)
 {
 	test_heap();
 	test_huffman();
+	test_huffman_code_table();
+	test_huffman_decoder();
+	test_huffman_decoder_multi();
+	test_huffman_canonical();
+	test_huffman_limit();
+	test_huffman_lengths();
+	test_huffman_count();
+	test_adaptive();
 	test_bitfile();
+	test_bitfile_rewind();
+	test_bitfile_seek();
+	test_bitfile_mmap();
+	test_bitfile_async();
+	test_bitfile_code();
+	test_bitfile_memory();
+	test_bitfile_align();
+	test_hcpak_memory();
+	test_hcpak_streams();
+	test_hcpak_blocks();
+	test_hcpak_threads();
+	test_hcpak_range();
+	test_hcpak_sample();
+	test_hcpak_stored();
+	test_hcpak_dict();
+	test_hcpak_msg();
+	test_hcpak_context();
+	test_hcpak_version1();
+	test_bitfile_peek();
 
 /* These are manual tests: */
 /* 	test_huffman2(); */
@@ -41,10 +41,11 @@ void error(const char *format, ...)
 {
 	va_list ap;
 
-	printf("Error: ");
+	/* Standard output may be carrying compressed data */
+	fprintf(stderr, "Error: ");
 	va_start(ap, format);
-	vprintf(format, ap);
+	vfprintf(stderr, format, ap);
 	va_end(ap);
-	printf("\n");
+	fprintf(stderr, "\n");
 	exit(1);
 }
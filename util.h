@@ -9,7 +9,9 @@
 
 /* Short versions of commonly used but long data types */
 typedef unsigned char u8;
+typedef unsigned short u16;
 typedef unsigned int u32;
+__extension__ typedef unsigned long long u64;
 
 /* Allocate 'size' bytes of memory, abort on failure */
 void * xmalloc(size_t size);
@@ -28,4 +30,11 @@ void error(const char *format, ...);
 #define BIT_UNSET(byte, pos) do { (byte) &= ~(1 << (7-pos)); } while(0)
 #define BIT_GET(byte, pos) (!!((byte) & (1 << (7-pos))))
 
+/* Load the 64-bit word at 'p', most significant byte first */
+#define LOAD_BE64(p) \
+	((u64)(p)[0] << 56 | (u64)(p)[1] << 48 | \
+	 (u64)(p)[2] << 40 | (u64)(p)[3] << 32 | \
+	 (u64)(p)[4] << 24 | (u64)(p)[5] << 16 | \
+	 (u64)(p)[6] << 8 | (u64)(p)[7])
+
 #endif /* __UTIL_H */